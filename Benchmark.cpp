@@ -0,0 +1,524 @@
+#include "MidiParser.hpp"
+#include "KorgCodec.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#ifdef _UNIX
+#include "InputDevice.hpp"
+#include "OutputDevice.hpp"
+#include "Loopback.hpp"
+#include "M3Emulator.hpp"
+#include "Transfer.hpp"
+#include "CombiLibrary.hpp"
+#include "Event.hpp"
+#include <atomic>
+#include <filesystem>
+#include <mutex>
+#endif
+
+typedef std::chrono::steady_clock Clock;
+
+static constexpr size_t ReadChunkSize { 4096 };
+static constexpr const char* DefaultResultsPath { "bench.csv" };
+// How long each transfer workload is repeated for.
+static constexpr std::chrono::milliseconds StageTime { 500 };
+
+// One line of the results file. Rates are left at zero where they mean nothing,
+// such as combis for the parser.
+struct StageResult
+{
+	const char* Stage;
+	size_t Combis = 0;
+	uint64_t Bytes = 0;
+	double Seconds = 0;
+	size_t Errors = 0;
+	// Microseconds, one per request or message timed.
+	std::vector<double> Latencies;
+};
+
+static std::vector<StageResult> s_results;
+
+static double Percentile(const std::vector<double>& sorted, unsigned percent)
+{
+	return sorted.empty() ? 0 : sorted[(sorted.size() - 1) * percent / 100];
+};
+
+// CSV with a header line, so runs of different builds can be diffed or loaded
+// into a spreadsheet side by side.
+static bool WriteResults(const char* path)
+{
+	FILE* file = fopen(path, "w");
+	if (file == nullptr)
+		return false;
+	fprintf(file, "stage,combis,bytes,seconds,combis_per_sec,bytes_per_sec,latency_p50_us,latency_p90_us,latency_p99_us,latency_max_us,errors\n");
+	for (auto& result : s_results)
+	{
+		std::sort(result.Latencies.begin(), result.Latencies.end());
+		double seconds = result.Seconds > 0 ? result.Seconds : 1;
+		fprintf(file, "%s,%zu,%llu,%.6f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%zu\n",
+			result.Stage, result.Combis, (unsigned long long)result.Bytes, result.Seconds,
+			result.Combis / seconds, result.Bytes / seconds,
+			Percentile(result.Latencies, 50), Percentile(result.Latencies, 90), Percentile(result.Latencies, 99),
+			result.Latencies.empty() ? 0 : result.Latencies.back(), result.Errors);
+	}
+	return fclose(file) == 0;
+};
+
+struct ParserCounts
+{
+	size_t ShortMessages = 0;
+	size_t SysexBytes = 0;
+};
+
+static void CountParsed(void* context, const Message& message)
+{
+	ParserCounts* counts = (ParserCounts*)context;
+	if (message.Buffer)
+		counts->SysexBytes += message.BufferSize;
+	else
+		++counts->ShortMessages;
+};
+
+// A few megabytes of what the M3 sends while dumping a bank: long SysEx with
+// Timing Clock every few dozen bytes and Active Sensing now and then, plus some
+// running-status note traffic in between.
+static std::vector<uint8_t> MakeDumpStream(size_t cbTarget)
+{
+	std::vector<uint8_t> stream;
+	stream.reserve(cbTarget + 1024);
+	while (stream.size() < cbTarget)
+	{
+		static constexpr uint8_t header[] = { 0xF0, 0x42, 0x30, 0x75, 0x73, 0x11, 0x40 };
+		stream.insert(stream.end(), header, header + sizeof(header));
+		for (size_t i = 0; i < 256 * 1024; ++i)
+		{
+			if (i % 97 == 0)
+				stream.push_back(0xF8);
+			if (i % 3001 == 0)
+				stream.push_back(0xFE);
+			stream.push_back((uint8_t)(i & 0x7F));
+		}
+		stream.push_back(0xF7);
+
+		stream.push_back(0x90);
+		for (uint8_t note = 36; note < 96; ++note)
+		{
+			stream.push_back(note);
+			stream.push_back(note == 60 ? 0 : 100);
+		}
+	}
+	return stream;
+};
+
+static void BenchParser()
+{
+	std::vector<uint8_t> stream = MakeDumpStream(8 * 1024 * 1024);
+	ParserCounts counts;
+	MidiParser parser(&CountParsed, &counts);
+
+	size_t cbParsed = 0;
+	auto start = Clock::now();
+	auto elapsed = Clock::duration::zero();
+	while (elapsed < std::chrono::milliseconds(500))
+	{
+		for (size_t i = 0; i < stream.size(); i += ReadChunkSize)
+			parser.Parse(&stream[i], i + ReadChunkSize > stream.size() ? stream.size() - i : ReadChunkSize);
+		cbParsed += stream.size();
+		elapsed = Clock::now() - start;
+	}
+
+	double seconds = std::chrono::duration<double>(elapsed).count();
+	printf("parser      %8.1f MB/s  (%zu bytes, %zu short messages, %zu SysEx bytes)\n",
+		cbParsed / seconds / 1e6, cbParsed, counts.ShortMessages, counts.SysexBytes);
+	s_results.push_back({ "parser", 0, cbParsed, seconds, 0, {} });
+};
+
+// Runs codec over the same data until half a second has passed; returns MB/s of input.
+static double TimeCodec(const char* stage, size_t (*codec)(const uint8_t*, size_t, uint8_t*), const std::vector<uint8_t>& in, std::vector<uint8_t>& out)
+{
+	size_t cbDone = 0;
+	auto start = Clock::now();
+	auto elapsed = Clock::duration::zero();
+	while (elapsed < std::chrono::milliseconds(500))
+	{
+		codec(in.data(), in.size(), out.data());
+		cbDone += in.size();
+		elapsed = Clock::now() - start;
+	}
+	double seconds = std::chrono::duration<double>(elapsed).count();
+	s_results.push_back({ stage, 0, cbDone, seconds, 0, {} });
+	return cbDone / seconds / 1e6;
+};
+
+static void BenchCodec()
+{
+	// About what a library of a few hundred combis holds.
+	std::vector<uint8_t> unpacked(1024 * 1024);
+	uint32_t seed = 1;
+	for (auto& b : unpacked)
+		b = (uint8_t)((seed = seed * 1103515245 + 12345) >> 16);
+	std::vector<uint8_t> packed(KorgPackedSize(unpacked.size()));
+	std::vector<uint8_t> roundTrip(unpacked.size());
+	KorgPack(unpacked.data(), unpacked.size(), packed.data());
+
+	double packScalar   = TimeCodec("pack_scalar", &KorgPackScalar, unpacked, packed);
+	double pack         = TimeCodec("pack", &KorgPack, unpacked, packed);
+	double unpackScalar = TimeCodec("unpack_scalar", &KorgUnpackScalar, packed, roundTrip);
+	double unpack       = TimeCodec("unpack", &KorgUnpack, packed, roundTrip);
+	bool ok = roundTrip == unpacked;
+
+	printf("pack        %8.1f MB/s  (scalar %.1f MB/s, %s, %.1fx)\n", pack, packScalar, KorgCodecName(), pack / packScalar);
+	printf("unpack      %8.1f MB/s  (scalar %.1f MB/s, %s, %.1fx)%s\n", unpack, unpackScalar, KorgCodecName(), unpack / unpackScalar, ok ? "" : "  MISMATCH");
+	printf("            %zu KB of combi data unpacks in %.1f us\n", unpacked.size() / 1024, packed.size() / unpack);
+};
+
+#ifdef _UNIX
+// Written by the dispatch thread while the benchmark reads them.
+struct LoopbackCounts
+{
+	std::atomic<size_t> SysexBytes = 0;
+	std::atomic<size_t> Messages = 0;
+	Event Finished;
+};
+
+static void CountLooped(void* context, [[maybe_unused]] void* sender, MIDIEventArgs& e)
+{
+	LoopbackCounts* counts = (LoopbackCounts*)context;
+	counts->SysexBytes += e.Message.BufferSize;
+	if (e.Message.BufferSize && e.Message.Buffer[e.Message.BufferSize - 1] == 0xF7)
+	{
+		++counts->Messages;
+		counts->Finished.Signal();
+	}
+};
+
+// The whole device path with no hardware: output queue and writer thread, an
+// unthrottled loopback, then the input's reader, parser and dispatch.
+static void BenchLoopback()
+{
+	Device::SetBackend(DeviceBackend::Loopback);
+	Loopback* link = Loopback::Get();
+	InputDevice* input = InputDevice::GetByName(Loopback::DefaultName);
+	OutputDevice* output = OutputDevice::GetByName(Loopback::DefaultName);
+	if (link == nullptr || input == nullptr || output == nullptr || !input->Open() || !output->Open())
+	{
+		printf("loopback    unavailable\n");
+		return;
+	}
+	link->Configure(LoopbackSettings {});
+	LoopbackCounts counts;
+	input->AddCallback(&CountLooped, &counts, MessageFilter().AddKorgSysex());
+
+	// Throughput: one dump-sized SysEx after another.
+	std::vector<uint8_t> dump(256 * 1024, 0x11);
+	static constexpr uint8_t header[] = { 0xF0, 0x42, 0x30, 0x75, 0x73, 0x11, 0x40 };
+	std::copy(header, header + sizeof(header), dump.begin());
+	dump.back() = 0xF7;
+	size_t cbSent = 0;
+	auto start = Clock::now();
+	while (Clock::now() - start < std::chrono::milliseconds(500))
+	{
+		output->LongMessage(dump.data(), dump.size());
+		cbSent += dump.size();
+	}
+	while (counts.SysexBytes < cbSent && counts.Finished.WaitFor(1000))
+		;
+	double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	size_t cbReceived = counts.SysexBytes;
+	printf("loopback    %8.1f MB/s  (%zu bytes sent, %zu received)\n", cbSent / seconds / 1e6, cbSent, cbReceived);
+	StageResult result { "loopback", 0, cbReceived, seconds, 0, {} };
+
+	// Latency: the stack's own overhead on a short message, one at a time.
+	std::vector<double> latencies;
+	static constexpr uint8_t request[] = { 0xF0, 0x42, 0x30, 0x75, 0x12, 0xF7 };
+	// A signal left over from the throughput run would time each sample
+	// against the message before it.
+	counts.Finished.Reset();
+	for (int i = 0; i < 2000; ++i)
+	{
+		auto sent = Clock::now();
+		output->LongMessage(request, sizeof(request));
+		if (!counts.Finished.WaitFor(1000))
+			break;
+		latencies.push_back(std::chrono::duration<double, std::micro>(Clock::now() - sent).count());
+	}
+	std::sort(latencies.begin(), latencies.end());
+	if (!latencies.empty())
+		printf("            one-way latency %.1f us median, %.1f us 99th percentile\n",
+			latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100]);
+	result.Latencies = std::move(latencies);
+	s_results.push_back(std::move(result));
+
+	input->RemoveCallbacks(&counts);
+	delete input;
+	delete output;
+};
+// Transactions finishing on the input thread, timed from when each was sent.
+static std::mutex s_latenciesLock;
+static std::vector<double>* s_latencies;
+
+static void RecordLatency(ReceiveContext* context)
+{
+	if (context->Status != ReceiveStatus::Finished)
+		return;
+	double latency = std::chrono::duration<double, std::micro>(Clock::now() - context->SentAt).count();
+	std::lock_guard<std::mutex> lock(s_latenciesLock);
+	if (s_latencies)
+		s_latencies->push_back(latency);
+};
+
+// One workload through the emulator, repeated until StageTime has passed: its
+// time, the MIDI bytes it moved both ways, and the latency of every request.
+class TransferStage
+{
+private:
+	StageResult m_result;
+	Loopback* m_link;
+	uint64_t m_bytesBefore;
+	Clock::time_point m_start;
+public:
+	TransferStage(const char* stage, Loopback* link)
+		: m_link(link)
+	{
+		m_result.Stage = stage;
+		{
+			std::lock_guard<std::mutex> lock(s_latenciesLock);
+			s_latencies = &m_result.Latencies;
+		}
+		m_bytesBefore = link->BytesToDevice() + link->BytesToHost();
+		m_start = Clock::now();
+	};
+
+	bool Again() const { return Clock::now() - m_start < StageTime; };
+
+	void End(size_t combis, size_t errors)
+	{
+		m_result.Seconds = std::chrono::duration<double>(Clock::now() - m_start).count();
+		m_result.Bytes = m_link->BytesToDevice() + m_link->BytesToHost() - m_bytesBefore;
+		m_result.Combis = combis;
+		m_result.Errors = errors;
+		{
+			std::lock_guard<std::mutex> lock(s_latenciesLock);
+			s_latencies = nullptr;
+		}
+		std::vector<double> sorted = m_result.Latencies;
+		std::sort(sorted.begin(), sorted.end());
+		printf("%-11s %8.1f combis/s  %6.2f MB/s  latency %.0f us median, %.0f us 99th percentile%s\n",
+			m_result.Stage, combis / m_result.Seconds, m_result.Bytes / m_result.Seconds / 1e6,
+			Percentile(sorted, 50), Percentile(sorted, 99), errors ? "  ERRORS" : "");
+		s_results.push_back(std::move(m_result));
+	};
+};
+
+// Dumps every combi of a bank one request at a time, as 'copynext' does.
+static void BenchDump(InputDevice* input, OutputDevice* output, Loopback* link, SysexBuilder& sysex)
+{
+	TransferStage stage("dump", link);
+	ReceiveContext context;
+	context.Initialise(input, output, RecordLatency);
+	PooledBuffer combiData;
+	uint8_t request[16];
+	size_t combis = 0;
+	size_t errors = 0;
+	do
+	{
+		for (size_t num = 0; num < CombiBank::CombisPerBank; ++num, ++combis)
+		{
+			context.FillSimple(request, sysex.CombiParameterDumpRequest(request, 0, (uint8_t)num), 0x73);
+			context.BufferIn = combiData;
+			context.cbBufferIn = combiData.Size();
+			if (!Transact(&context, RetryPolicy {}))
+				++errors;
+		}
+	} while (stage.Again());
+	stage.End(combis, errors);
+};
+
+static void BenchBankDump(InputDevice* input, OutputDevice* output, Loopback* link, SysexBuilder& sysex)
+{
+	TransferStage stage("bankdump", link);
+	TransactionTable transactions(input, output);
+	size_t combis = 0;
+	size_t errors = 0;
+	do
+	{
+		for (uint8_t bank = 0; bank < 7; ++bank, combis += CombiBank::CombisPerBank)
+		{
+			CombiBank fetched;
+			if (!fetched.Fetch(transactions, sysex, bank, RecordLatency))
+				++errors;
+		}
+	} while (stage.Again());
+	stage.End(combis, errors);
+};
+
+// A copy of a bank's worth of combis. Spread over sources, each is fetched on
+// its own with downloads and uploads overlapping; from one source bank, the
+// bank is fetched whole and only the uploads are pipelined.
+static void BenchCopy(InputDevice* input, OutputDevice* output, Loopback* link, SysexBuilder& sysex, const char* name, bool oneSource)
+{
+	std::vector<CopyJob> jobs;
+	for (size_t i = 0; i < CombiBank::CombisPerBank; ++i)
+	{
+		uint8_t source = oneSource ? 4 : (uint8_t)(1 + i % 4);
+		jobs.push_back({ source, (uint8_t)(CombiBank::CombisPerBank - 1 - i), 0x40, (uint8_t)i });
+	}
+
+	TransferStage stage(name, link);
+	size_t combis = 0;
+	size_t errors = 0;
+	do
+	{
+		CopyPipeline pipeline(input, output, sysex, 8);
+		pipeline.SetBankDumps(oneSource);
+		if (!pipeline.Run(jobs.data(), jobs.size(), RecordLatency))
+			++errors;
+		combis += jobs.size();
+		errors += pipeline.Errors();
+	} while (stage.Again());
+	stage.End(combis, errors);
+};
+
+// Every internal bank into a combi library file and back again, as 'libsave'
+// and 'libupload' do, each restored bank then written to flash.
+static void BenchBackupRestore(InputDevice* input, OutputDevice* output, Loopback* link, SysexBuilder& sysex)
+{
+	static constexpr uint8_t BankCount { 7 };
+	std::error_code error;
+	std::string path = (std::filesystem::temp_directory_path(error) / "M3Bench.lib").string();
+
+	{
+		TransferStage stage("backup", link);
+		TransactionTable transactions(input, output);
+		PooledBuffer dump;
+		size_t combis = 0;
+		size_t errors = 0;
+		do
+		{
+			CombiLibraryWriter writer;
+			for (uint8_t bank = 0; bank < BankCount; ++bank)
+			{
+				CombiBank fetched;
+				if (!fetched.Fetch(transactions, sysex, bank, RecordLatency))
+				{
+					++errors;
+					continue;
+				}
+				for (size_t num = 0; num < CombiBank::CombisPerBank; ++num)
+				{
+					size_t cbDump = fetched.Slice(sysex, (uint8_t)num, dump, dump.Size());
+					if (cbDump == 0 || !writer.Add(bank, (uint8_t)num, dump, cbDump))
+						++errors;
+				}
+			}
+			if (!writer.Save(path.c_str()))
+				++errors;
+			combis += writer.Count();
+		} while (stage.Again());
+		stage.End(combis, errors);
+	}
+
+	CombiLibrary library;
+	if (!library.Open(path.c_str()))
+	{
+		printf("restore     unavailable\n");
+		return;
+	}
+	{
+		// Each combi goes back where it came from, straight from the mapping.
+		TransferStage stage("restore", link);
+		ReceiveContext context;
+		context.Initialise(input, output, RecordLatency);
+		uint8_t request[16];
+		size_t combis = 0;
+		size_t errors = 0;
+		do
+		{
+			for (uint8_t bank = 0; bank < BankCount; ++bank)
+			{
+				for (size_t num = 0; num < CombiBank::CombisPerBank; ++num)
+				{
+					size_t cbDump;
+					const uint8_t* dump = library.Get(bank, (uint8_t)num, &cbDump);
+					if (dump == nullptr)
+					{
+						++errors;
+						continue;
+					}
+					context.FillSimple(dump, cbDump, 0x24);
+					if (Transact(&context, RetryPolicy {}))
+						++combis;
+					else
+						++errors;
+				}
+				context.FillSimple(request, sysex.StoreCombinationBank(request, bank), 0x24);
+				context.MinimumTimeout = FlashWriteTimeout;
+				if (!Transact(&context, RetryPolicy {}))
+					++errors;
+			}
+		} while (stage.Again());
+		stage.End(combis, errors);
+	}
+	library.Close();
+	std::filesystem::remove(path, error);
+};
+
+// The transfer layer against an emulated M3 that answers at once over an
+// unthrottled loopback, so the times are this program's own: request and
+// reply matching, pipelining, parsing and the device path.
+static void BenchTransfer()
+{
+	static constexpr const char* LinkName { "emulator" };
+	Device::SetBackend(DeviceBackend::Loopback);
+	Loopback* link = Loopback::Get(LinkName);
+	if (link == nullptr)
+	{
+		printf("transfer    unavailable\n");
+		return;
+	}
+	link->Configure(LoopbackSettings {});
+	M3Emulator emulator(link);
+	emulator.SetTiming(EmulatorTiming { 0, 0, 0, 0, 0 });
+
+	InputDevice* input = InputDevice::GetByName(LinkName);
+	OutputDevice* output = OutputDevice::GetByName(LinkName);
+	if (input == nullptr || output == nullptr || !input->Open() || !output->Open())
+	{
+		printf("transfer    unavailable\n");
+		delete input;
+		delete output;
+		return;
+	}
+
+	SysexBuilder sysex(0);
+	BenchDump(input, output, link, sysex);
+	BenchBankDump(input, output, link, sysex);
+	BenchCopy(input, output, link, sysex, "copy", false);
+	BenchCopy(input, output, link, sysex, "copybank", true);
+	BenchBackupRestore(input, output, link, sysex);
+
+	delete input;
+	delete output;
+};
+#endif
+
+int main(int argc, const char* argv[])
+{
+	BenchParser();
+	BenchCodec();
+#ifdef _UNIX
+	BenchLoopback();
+	BenchTransfer();
+#endif
+
+	const char* path = argc > 1 ? argv[1] : DefaultResultsPath;
+	if (!WriteResults(path))
+	{
+		fprintf(stderr, "Couldn't write benchmark results to %s\n", path);
+		return 1;
+	}
+	printf("Results written to %s\n", path);
+	return 0;
+};
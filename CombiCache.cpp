@@ -0,0 +1,121 @@
+#include "CombiCache.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+
+static constexpr uint32_t CacheMagic { 0x4343334D }; // "M3CC"
+
+struct CacheFileHeader
+{
+	uint32_t Magic;
+	uint32_t Length;
+	uint64_t Hash;
+};
+
+CombiCache::CombiCache()
+{
+	const char* base;
+#ifdef _WIN32
+	if ((base = getenv("LOCALAPPDATA")) != nullptr)
+		m_directory = std::string(base) + "\\m3-helper\\combis";
+#else
+	if ((base = getenv("XDG_CACHE_HOME")) != nullptr && *base)
+		m_directory = std::string(base) + "/m3-helper/combis";
+	else if ((base = getenv("HOME")) != nullptr)
+		m_directory = std::string(base) + "/.cache/m3-helper/combis";
+#endif
+	Enable(true);
+};
+
+void CombiCache::Enable(bool enable)
+{
+	std::error_code error;
+	m_enabled = enable && !m_directory.empty()
+		&& (std::filesystem::create_directories(m_directory, error) || std::filesystem::is_directory(m_directory, error));
+};
+
+std::string CombiCache::PathFor(uint8_t bank, uint8_t num) const
+{
+	char name[32];
+	snprintf(name, sizeof(name), "/%02X-%03u.syx", bank, num);
+	return m_directory + name;
+};
+
+uint64_t CombiCache::Hash(const uint8_t* data, size_t cbData)
+{
+	uint64_t hash = 0xCBF29CE484222325ull;
+	for (size_t i = 0; i < cbData; ++i)
+		hash = (hash ^ data[i]) * 0x100000001B3ull;
+	return hash;
+};
+
+size_t CombiCache::Load(uint8_t bank, uint8_t num, uint8_t* buffer, size_t cbBuffer) const
+{
+	if (!m_enabled)
+		return 0;
+
+	FILE* file = fopen(PathFor(bank, num).c_str(), "rb");
+	if (file == nullptr)
+		return 0;
+
+	CacheFileHeader header;
+	size_t size = 0;
+	if (fread(&header, sizeof(header), 1, file) == 1 && header.Magic == CacheMagic
+		&& header.Length <= cbBuffer && fread(buffer, 1, header.Length, file) == header.Length
+		&& Hash(buffer, header.Length) == header.Hash)
+		size = header.Length;
+	fclose(file);
+
+	// Only hand back something that looks like the dump of the slot asked for.
+	if (size < 10 || buffer[0] != 0xF0 || buffer[4] != 0x73 || buffer[6] != bank || buffer[8] != num || buffer[size - 1] != 0xF7)
+		return 0;
+	return size;
+};
+
+bool CombiCache::Store(uint8_t bank, uint8_t num, const uint8_t* data, size_t cbData)
+{
+	if (!m_enabled)
+		return false;
+
+	// Write to the side and rename, so a crash never leaves a half-written entry.
+	std::string path = PathFor(bank, num);
+	std::string temporary = path + ".tmp";
+	FILE* file = fopen(temporary.c_str(), "wb");
+	if (file == nullptr)
+		return false;
+
+	CacheFileHeader header { CacheMagic, (uint32_t)cbData, Hash(data, cbData) };
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(data, 1, cbData, file) == cbData;
+	ok = fclose(file) == 0 && ok;
+
+	std::error_code error;
+	if (ok)
+		std::filesystem::rename(temporary, path, error);
+	if (!ok || error)
+	{
+		std::filesystem::remove(temporary, error);
+		return false;
+	}
+	return true;
+};
+
+// Even while the cache is off, so a slot written meanwhile isn't served from
+// an old entry once it's back on.
+void CombiCache::Invalidate(uint8_t bank, uint8_t num)
+{
+	if (m_directory.empty())
+		return;
+	std::error_code error;
+	std::filesystem::remove(PathFor(bank, num), error);
+};
+
+void CombiCache::Clear()
+{
+	if (m_directory.empty())
+		return;
+	std::error_code error;
+	for (const auto& entry : std::filesystem::directory_iterator(m_directory, error))
+		if (entry.path().extension() == ".syx")
+			std::filesystem::remove(entry.path(), error);
+};
@@ -0,0 +1,31 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+// Combi dumps kept on disk between sessions, one file per bank/number, so
+// copying a combi that has been fetched before only costs the upload. Each
+// file carries the length and an FNV-1a hash of the dump, checked on load.
+//
+// The cache can't see edits made on the keyboard itself, only writes made by
+// this tool, which invalidate the slot written to.
+class CombiCache
+{
+private:
+	std::string m_directory;
+	bool m_enabled = false;
+
+	std::string PathFor(uint8_t bank, uint8_t num) const;
+public:
+	CombiCache();
+	bool IsEnabled() const { return m_enabled; };
+	// Turns Load and Store on or off; Invalidate and Clear always apply.
+	void Enable(bool enable);
+	const char* Directory() const { return m_directory.c_str(); };
+	// Returns the size of the dump copied into buffer, or 0 if there's no valid entry.
+	size_t Load(uint8_t bank, uint8_t num, uint8_t* buffer, size_t cbBuffer) const;
+	bool Store(uint8_t bank, uint8_t num, const uint8_t* data, size_t cbData);
+	void Invalidate(uint8_t bank, uint8_t num);
+	void Clear();
+	static uint64_t Hash(const uint8_t* data, size_t cbData);
+};
@@ -0,0 +1,93 @@
+#include "CombiLibrary.hpp"
+#include <cstdio>
+#include <cstring>
+
+static constexpr size_t DumpsOffset { sizeof(LibraryHeader) + LibrarySlotCount * sizeof(LibraryEntry) };
+
+int CombiLibrary::SlotIndex(uint8_t bank, uint8_t num)
+{
+	if ((bank & ~0x47) || num >= 128)
+		return -1;
+	return (((bank & 0x40) >> 3) | (bank & 7)) * 128 + num;
+};
+
+size_t CombiLibrary::Count() const
+{
+	return m_base ? ((const LibraryHeader*)m_base)->Count : 0;
+};
+
+const uint8_t* CombiLibrary::Get(uint8_t bank, uint8_t num, size_t* cbDump) const
+{
+	int slot = SlotIndex(bank, num);
+	if (m_base == nullptr || slot < 0 || m_index[slot].Length == 0)
+		return nullptr;
+	*cbDump = m_index[slot].Length;
+	return m_base + m_index[slot].Offset;
+};
+
+// Checks everything Get() relies on, once, so lookups don't have to.
+static bool Validate(const uint8_t* base, size_t size)
+{
+	if (size < DumpsOffset)
+		return false;
+	const LibraryHeader* header = (const LibraryHeader*)base;
+	if (header->Magic != LibraryMagic || header->Version != LibraryVersion || header->SlotCount != LibrarySlotCount
+		|| header->IndexOffset != sizeof(LibraryHeader) || header->FileSize != size)
+		return false;
+
+	const LibraryEntry* index = (const LibraryEntry*)(base + header->IndexOffset);
+	for (size_t i = 0; i < LibrarySlotCount; ++i)
+	{
+		if (index[i].Length == 0)
+			continue;
+		if (index[i].Offset < DumpsOffset || index[i].Length < 10 || index[i].Offset + (uint64_t)index[i].Length > size
+			|| base[index[i].Offset] != 0xF0 || base[index[i].Offset + index[i].Length - 1] != 0xF7)
+			return false;
+	}
+	return true;
+};
+
+CombiLibraryWriter::CombiLibraryWriter()
+	: m_index(LibrarySlotCount, LibraryEntry { 0, 0 })
+{ };
+
+bool CombiLibraryWriter::Add(uint8_t bank, uint8_t num, const uint8_t* dump, size_t cbDump)
+{
+	int slot = CombiLibrary::SlotIndex(bank, num);
+	if (slot < 0 || cbDump < 10 || dump[0] != 0xF0 || dump[cbDump - 1] != 0xF7
+		|| DumpsOffset + m_dumps.size() + cbDump > UINT32_MAX)
+		return false;
+
+	if (m_index[slot].Length == 0)
+		++m_count;
+	m_index[slot].Offset = (uint32_t)(DumpsOffset + m_dumps.size());
+	m_index[slot].Length = (uint32_t)cbDump;
+	m_dumps.insert(m_dumps.end(), dump, dump + cbDump);
+	return true;
+};
+
+bool CombiLibraryWriter::Save(const char* path) const
+{
+	FILE* file = fopen(path, "wb");
+	if (file == nullptr)
+		return false;
+
+	LibraryHeader header {};
+	header.Magic       = LibraryMagic;
+	header.Version     = LibraryVersion;
+	header.SlotCount   = LibrarySlotCount;
+	header.IndexOffset = sizeof(LibraryHeader);
+	header.FileSize    = DumpsOffset + m_dumps.size();
+	header.Count       = (uint32_t)m_count;
+
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+		&& fwrite(m_index.data(), sizeof(LibraryEntry), m_index.size(), file) == m_index.size()
+		&& fwrite(m_dumps.data(), 1, m_dumps.size(), file) == m_dumps.size();
+	return fclose(file) == 0 && ok;
+};
+
+#ifdef _WIN32
+#include "CombiLibrary.win32.cpp"
+#else
+#include "CombiLibrary.unix.cpp"
+#endif
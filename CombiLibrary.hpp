@@ -0,0 +1,71 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// On-disk collection of combi dumps, laid out so it can be memory-mapped and
+// used in place:
+//
+//   LibraryHeader                        fixed size
+//   LibraryEntry[LibrarySlotCount]       one per bank/number, zero length if empty
+//   dumps                                complete F0h..F7h messages, back to back
+//
+// All fields are little-endian. A dump can go straight from the mapping to
+// OutputDevice::LongMessage.
+static constexpr uint32_t LibraryMagic     { 0x4C43334D }; // "M3CL"
+static constexpr uint32_t LibraryVersion   { 1 };
+static constexpr size_t   LibraryBankCount { 16 };         // I-A..I-H, U-A..U-H
+static constexpr size_t   LibrarySlotCount { LibraryBankCount * 128 };
+
+struct LibraryHeader
+{
+	uint32_t Magic;
+	uint32_t Version;
+	uint32_t SlotCount;
+	uint32_t IndexOffset;
+	uint64_t FileSize;
+	uint32_t Count;
+	uint32_t Reserved;
+};
+
+struct LibraryEntry
+{
+	uint32_t Offset;
+	uint32_t Length;
+};
+
+static_assert(sizeof(LibraryHeader) == 32, "LibraryHeader must match the file format");
+static_assert(sizeof(LibraryEntry) == 8, "LibraryEntry must match the file format");
+
+class CombiLibrary
+{
+private:
+	const uint8_t* m_base = nullptr;
+	size_t m_size = 0;
+	const LibraryEntry* m_index = nullptr;
+public:
+	// Position of a bank/number in the index, or -1 if it can't be stored.
+	static int SlotIndex(uint8_t bank, uint8_t num);
+
+	CombiLibrary() = default;
+	~CombiLibrary();
+	bool Open(const char* path);
+	void Close();
+	bool IsOpen() const { return m_base != nullptr; };
+	size_t Count() const;
+	// Points into the mapping; valid until Close().
+	const uint8_t* Get(uint8_t bank, uint8_t num, size_t* cbDump) const;
+};
+
+class CombiLibraryWriter
+{
+private:
+	std::vector<LibraryEntry> m_index;
+	std::vector<uint8_t> m_dumps;
+	size_t m_count = 0;
+public:
+	CombiLibraryWriter();
+	bool Add(uint8_t bank, uint8_t num, const uint8_t* dump, size_t cbDump);
+	bool Save(const char* path) const;
+	size_t Count() const { return m_count; };
+};
@@ -0,0 +1,48 @@
+#include "CombiLibrary.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+CombiLibrary::~CombiLibrary()
+{
+	Close();
+};
+
+bool CombiLibrary::Open(const char* path)
+{
+	Close();
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	void* base = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size > 0)
+		base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	// The mapping keeps the file alive.
+	close(fd);
+	if (base == MAP_FAILED)
+		return false;
+
+	if (!Validate((const uint8_t*)base, st.st_size))
+	{
+		munmap(base, st.st_size);
+		return false;
+	}
+
+	m_base = (const uint8_t*)base;
+	m_size = st.st_size;
+	m_index = (const LibraryEntry*)(m_base + sizeof(LibraryHeader));
+	return true;
+};
+
+void CombiLibrary::Close()
+{
+	if (m_base)
+		munmap((void*)m_base, m_size);
+	m_base = nullptr;
+	m_size = 0;
+	m_index = nullptr;
+};
@@ -0,0 +1,50 @@
+#include "CombiLibrary.hpp"
+#include <windows.h>
+
+CombiLibrary::~CombiLibrary()
+{
+	Close();
+};
+
+bool CombiLibrary::Open(const char* path)
+{
+	Close();
+
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER size;
+	HANDLE mapping = NULL;
+	const void* base = nullptr;
+	if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping != NULL)
+		base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	// The view keeps the mapping and the file alive.
+	if (mapping != NULL)
+		CloseHandle(mapping);
+	CloseHandle(file);
+	if (base == nullptr)
+		return false;
+
+	if (!Validate((const uint8_t*)base, (size_t)size.QuadPart))
+	{
+		UnmapViewOfFile(base);
+		return false;
+	}
+
+	m_base = (const uint8_t*)base;
+	m_size = (size_t)size.QuadPart;
+	m_index = (const LibraryEntry*)(m_base + sizeof(LibraryHeader));
+	return true;
+};
+
+void CombiLibrary::Close()
+{
+	if (m_base)
+		UnmapViewOfFile(m_base);
+	m_base = nullptr;
+	m_size = 0;
+	m_index = nullptr;
+};
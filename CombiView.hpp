@@ -0,0 +1,36 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <string_view>
+
+// Reads combination parameters straight out of unpacked dump data (the part
+// of a CombiParameterDumpRequest reply after the header, run through
+// KorgUnpack), without copying or parsing anything up front.
+//
+// The layout constants are the only place that knows where things are. Only
+// the name has been checked against dumps from an M3; other fields are to be
+// added as they are confirmed.
+class CombiView
+{
+public:
+	static constexpr size_t NameOffset      { 0x00 };
+	static constexpr size_t NameLength      { 24 };
+
+	static constexpr size_t MinimumSize     { NameOffset + NameLength };
+private:
+	const uint8_t* m_data;
+	size_t m_size;
+public:
+	inline CombiView(const uint8_t* data, size_t size) : m_data(data), m_size(size) { };
+
+	inline bool IsValid() const { return m_data != nullptr && m_size >= MinimumSize; };
+
+	// Without the space/NUL padding.
+	inline std::string_view Name() const
+	{
+		size_t length = NameLength;
+		while (length > 0 && (m_data[NameOffset + length - 1] == ' ' || m_data[NameOffset + length - 1] == '\0'))
+			--length;
+		return std::string_view((const char*)m_data + NameOffset, length);
+	};
+};
@@ -1,5 +1,7 @@
 #include "Device.hpp"
 
+DeviceBackend Device::s_backend = DeviceBackend::RawMidi;
+
 Device::Device()
 { };
 
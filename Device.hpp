@@ -3,6 +3,7 @@
 #include <cstdint>
 #include <string>
 #include <list>
+#include <chrono>
 
 static constexpr uint32_t FLAG_INPUT  { 0x10000 };
 static constexpr uint32_t FLAG_OUTPUT { 0x20000 };
@@ -114,10 +115,67 @@ struct MIDIEventArgs
 public:
 	const struct Message Message;
 	bool Cancel = false;
-	inline MIDIEventArgs(const struct Message message) : Message(message) {};
+	// When the message arrived: stamped by the driver where the backend can,
+	// otherwise when it was read. Zero if unknown.
+	std::chrono::steady_clock::time_point Timestamp;
+	inline MIDIEventArgs(const struct Message message, std::chrono::steady_clock::time_point timestamp = {}) : Message(message), Timestamp(timestamp) {};
 };
 typedef void (*MIDIEventHandler)(void* context, void* sender, MIDIEventArgs& e);
-typedef std::pair<void*, MIDIEventHandler> MIDIEvent;
+
+// The messages a callback wants, as a bit per channel message type, per system
+// message and per Korg SysEx function code, so dispatch is a bit test per
+// callback. SysEx that isn't Korg's counts as SystemMessageType::SysExStart.
+// The pieces a long SysEx arrives in all count as whatever its first one does.
+class MessageFilter
+{
+public:
+	static constexpr unsigned KorgFunctions { 128 };
+private:
+	uint64_t m_bits[4] {};
+
+	static constexpr unsigned Bit(MessageType type) { return (unsigned)type - 8; };
+	static constexpr unsigned Bit(SystemMessageType type) { return 16 + (unsigned)type; };
+	static constexpr unsigned KorgBit(uint8_t function) { return KorgFunctions + (function & 0x7F); };
+	constexpr MessageFilter& Set(unsigned bit) { m_bits[bit >> 6] |= 1ull << (bit & 63); return *this; };
+public:
+	constexpr MessageFilter() = default;
+	static constexpr MessageFilter All() { MessageFilter filter; for (auto& bits : filter.m_bits) bits = ~0ull; return filter; };
+	constexpr MessageFilter& Add(MessageType type) { return Set(Bit(type)); };
+	constexpr MessageFilter& Add(SystemMessageType type) { return Set(Bit(type)); };
+	constexpr MessageFilter& Remove(SystemMessageType type) { m_bits[0] &= ~(1ull << Bit(type)); return *this; };
+	constexpr MessageFilter& AddKorgFunction(uint8_t function) { return Set(KorgBit(function)); };
+	constexpr MessageFilter& AddKorgSysex() { m_bits[2] = m_bits[3] = ~0ull; return *this; };
+	constexpr bool Test(unsigned bit) const { return (m_bits[bit >> 6] >> (bit & 63)) & 1; };
+
+	// The bit of a short message or of the first piece of a SysEx, which has to
+	// hold at least the five bytes up to the function code.
+	static inline unsigned BitOf(const Message& message)
+	{
+		if (message.Status != 0xF0)
+			return message.Type() == MessageType::System ? Bit(message.SubType()) : Bit(message.Type());
+		if (message.BufferSize >= 5 && message.Buffer[1] == 0x42)
+			return KorgBit(message.Buffer[4]);
+		return Bit(SystemMessageType::SysExStart);
+	};
+};
+
+struct MIDIEvent
+{
+	void* Context;
+	MIDIEventHandler Handler;
+	MessageFilter Filter;
+};
+
+// The driver interface devices are found and opened through. Only Linux has a
+// choice: rawmidi opens a port exclusively, while the ALSA sequencer lets
+// other applications use the same port at the same time. Loopback devices
+// are in-process connections with no hardware behind them (Loopback.hpp).
+enum class DeviceBackend
+{
+	RawMidi,
+	Sequencer,
+	Loopback
+};
 
 #ifdef _WIN32
 #include "Device.win32.hpp"
@@ -139,4 +197,10 @@ public:
 	virtual const char* Name() const = 0;
 protected:
 	static void GlobalMidiCallback(void*);
+private:
+	static DeviceBackend s_backend;
+public:
+	// Applies to devices looked up or enumerated afterwards.
+	static void SetBackend(DeviceBackend backend) { s_backend = backend; };
+	static DeviceBackend Backend() { return s_backend; };
 };
@@ -1,51 +1,332 @@
 #include "InputDevice.hpp"
+#include "Loopback.hpp"
 #include <alsa/asoundlib.h>
 #include <linux/soundcard.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
 
-int GetNumSubdevicesForDevice(snd_ctl_t* ctl, int card, int device, bool input)
+#include "Device.unix.inc"
+
+DeviceRegistry::DeviceRegistry()
+{
+	// Without a watch, the registry is read again on every query instead.
+	m_watchFd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	m_wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (m_watchFd >= 0 && m_wakeFd >= 0
+		&& inotify_add_watch(m_watchFd, "/dev/snd", IN_CREATE | IN_DELETE | IN_ATTRIB) >= 0)
+	{
+		m_watching = true;
+		m_watcher = std::thread(&DeviceRegistry::Watch, this);
+	}
+	else
+		fprintf(stderr, "Can't watch for MIDI devices being plugged in: %s\n", strerror(errno));
+};
+
+DeviceRegistry::~DeviceRegistry()
+{
+	if (m_watcher.joinable())
+	{
+		uint64_t one = 1;
+		if (write(m_wakeFd, &one, sizeof(one)) == sizeof(one))
+			m_watcher.join();
+		else
+			m_watcher.detach();
+	}
+	if (m_watchFd >= 0)
+		close(m_watchFd);
+	if (m_wakeFd >= 0)
+		close(m_wakeFd);
+};
+
+// Marks the registry out of date whenever a card's control or MIDI nodes
+// appear, disappear or change permissions, as udev does after creating them.
+void DeviceRegistry::Watch()
 {
-	snd_rawmidi_info_t *info;
+	struct pollfd fds[2] = { { m_wakeFd, POLLIN, 0 }, { m_watchFd, POLLIN, 0 } };
+	alignas(struct inotify_event) char buffer[4096];
+	for (;;)
+	{
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		if (fds[0].revents)
+			return;
+
+		ssize_t cbRead = read(m_watchFd, buffer, sizeof(buffer));
+		for (ssize_t offset = 0; offset < cbRead; )
+		{
+			const struct inotify_event* ev = (const struct inotify_event*)&buffer[offset];
+			if ((ev->mask & IN_Q_OVERFLOW) || (ev->len && (strncmp(ev->name, "controlC", 8) == 0 || strncmp(ev->name, "midiC", 5) == 0)))
+				m_stale = true;
+			offset += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+};
 
+void DeviceRegistry::AddSubdevices(snd_ctl_t* ctl, const char* cardName, int card, int device, bool input)
+{
+	Direction& direction = input ? m_inputs : m_outputs;
+	snd_rawmidi_info_t* info;
 	snd_rawmidi_info_alloca(&info);
 	snd_rawmidi_info_set_device(info, device);
-
 	snd_rawmidi_info_set_stream(info, input ? SND_RAWMIDI_STREAM_INPUT : SND_RAWMIDI_STREAM_OUTPUT);
-
 	if (snd_ctl_rawmidi_info(ctl, info) < 0)
-		return 0;
+		return;
 
-	return snd_rawmidi_info_get_subdevices_count(info);
+	unsigned int nSubdevices = snd_rawmidi_info_get_subdevices_count(info);
+	for (unsigned int subdevice = 0; subdevice < nSubdevices; ++subdevice)
+	{
+		snd_rawmidi_info_set_subdevice(info, subdevice);
+		if (snd_ctl_rawmidi_info(ctl, info) < 0)
+			continue;
+
+		char address[32];
+		DeviceEntry entry;
+		entry.Card = card;
+		entry.Device = device;
+		entry.Subdevice = (int)subdevice;
+		entry.Name = snd_rawmidi_info_get_subdevice_name(info);
+		if (entry.Name.empty())
+			entry.Name = snd_rawmidi_info_get_name(info);
+		snprintf(address, sizeof(address), "hw:%d,%d,%u", card, device, subdevice);
+		entry.Address = address;
+
+		// The first of several devices with the same name wins.
+		size_t index = direction.Entries.size();
+		direction.ByName.emplace(entry.Name, index);
+		if (cardName)
+			direction.ByName.emplace(std::string(cardName) + ":" + std::to_string(device) + ":" + std::to_string(subdevice), index);
+		direction.Entries.push_back(std::move(entry));
+	}
 };
 
-int GetNumDevicesForCard(int card, bool input)
+void DeviceRegistry::Rebuild()
 {
-	int nDevices = 0;
-	snd_ctl_t* ctl;
-	char name[32];
-	int device = -1;
+	m_inputs = {};
+	m_outputs = {};
 
-	snprintf(name, 32, "hw:%d", card);
-	if (snd_ctl_open(&ctl, name, 0) < 0)
-		return nDevices;
+	int card = -1;
+	while (snd_card_next(&card) >= 0 && card >= 0)
+	{
+		snd_ctl_t* ctl;
+		char name[32];
+		snprintf(name, 32, "hw:%d", card);
+		if (snd_ctl_open(&ctl, name, 0) < 0)
+			continue;
 
-	while (snd_ctl_rawmidi_next_device(ctl, &device) >= 0 && device >= 0)
-		nDevices += GetNumSubdevicesForDevice(ctl, card, device, input);
+		char* cardName = nullptr;
+		if (snd_card_get_name(card, &cardName) < 0)
+			cardName = nullptr;
+		int device = -1;
+		while (snd_ctl_rawmidi_next_device(ctl, &device) >= 0 && device >= 0)
+		{
+			AddSubdevices(ctl, cardName, card, device, true);
+			AddSubdevices(ctl, cardName, card, device, false);
+		}
+		free(cardName);
+		snd_ctl_close(ctl);
+	}
+};
 
-	snd_ctl_close(ctl);
+// Brings the registry up to date. The caller holds m_lock.
+DeviceRegistry::Direction& DeviceRegistry::Refresh(bool input)
+{
+	// Cleared first, so a card that shows up during the rebuild marks it stale again.
+	if (m_stale.exchange(false) || !m_watching)
+		Rebuild();
+	return input ? m_inputs : m_outputs;
+};
 
-	return nDevices;
+size_t DeviceRegistry::Count(bool input)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	return Refresh(input).Entries.size();
 };
 
-int GetTotalDeviceCount(bool input)
+bool DeviceRegistry::At(bool input, size_t index, DeviceEntry* out)
 {
-	int card = -1;
-	int nCards = 0;
-	int nTotalDevices = 0;
-	while (snd_card_next(&card) >= 0 && card >= 0)
+	std::lock_guard<std::mutex> lock(m_lock);
+	Direction& direction = Refresh(input);
+	if (index >= direction.Entries.size())
+		return false;
+	*out = direction.Entries[index];
+	return true;
+};
+
+bool DeviceRegistry::Find(bool input, const char* name, DeviceEntry* out)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	Direction& direction = Refresh(input);
+	auto found = direction.ByName.find(name);
+	if (found == direction.ByName.end())
+		return false;
+	*out = direction.Entries[found->second];
+	return true;
+};
+
+DeviceRegistry& Devices()
+{
+	static DeviceRegistry registry;
+	return registry;
+};
+
+bool RawMidiIsNamed(snd_rawmidi_t* handle, const char* name)
+{
+	snd_rawmidi_info_t* info;
+	snd_rawmidi_info_alloca(&info);
+	return snd_rawmidi_info(handle, info) >= 0 && strcmp(snd_rawmidi_info_get_subdevice_name(info), name) == 0;
+};
+
+// Opens a non-blocking client of the ALSA sequencer, named so other
+// applications can tell what is sharing the port with them.
+snd_seq_t* OpenSequencerClient(int streams)
+{
+	snd_seq_t* seq;
+	int status;
+	if ((status = snd_seq_open(&seq, "default", streams, SND_SEQ_NONBLOCK)) < 0)
+	{
+		fprintf(stderr, "Failed to open the ALSA sequencer: %s\n", snd_strerror(status));
+		return nullptr;
+	}
+	snd_seq_set_client_name(seq, "M3 Helper");
+	return seq;
+};
+
+// Whether a port carries MIDI and can be subscribed to in the direction asked
+// for: input ports are read from, output ports written to.
+static bool IsUsableSequencerPort(const snd_seq_port_info_t* info, bool input)
+{
+	unsigned int needed = input
+		? SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ
+		: SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE;
+	unsigned int capability = snd_seq_port_info_get_capability(info);
+	return (snd_seq_port_info_get_type(info) & SND_SEQ_PORT_TYPE_MIDI_GENERIC)
+		&& (capability & needed) == needed
+		&& !(capability & SND_SEQ_PORT_CAP_NO_EXPORT);
+};
+
+// Steps client/port on to the next usable port, starting from client -1.
+bool NextSequencerPort(snd_seq_t* seq, int* client, int* port, bool input)
+{
+	snd_seq_client_info_t* cinfo;
+	snd_seq_port_info_t* pinfo;
+	snd_seq_client_info_alloca(&cinfo);
+	snd_seq_port_info_alloca(&pinfo);
+
+	for (;;)
 	{
-		++nCards;
-		nTotalDevices += GetNumDevicesForCard(card, input);
+		if (*client >= 0)
+		{
+			snd_seq_port_info_set_client(pinfo, *client);
+			snd_seq_port_info_set_port(pinfo, *port);
+			while (snd_seq_query_next_port(seq, pinfo) >= 0)
+			{
+				*port = snd_seq_port_info_get_port(pinfo);
+				if (IsUsableSequencerPort(pinfo, input))
+					return true;
+			}
+		}
+
+		snd_seq_client_info_set_client(cinfo, *client);
+		if (snd_seq_query_next_client(seq, cinfo) < 0)
+			return false;
+		*client = snd_seq_client_info_get_client(cinfo);
+		*port = -1;
 	}
-	return nTotalDevices;
 };
 
+bool GetSequencerPortName(snd_seq_t* seq, int client, int port, char* out, size_t cchOut)
+{
+	snd_seq_port_info_t* info;
+	snd_seq_port_info_alloca(&info);
+	if (snd_seq_get_any_port_info(seq, client, port, info) < 0)
+		return false;
+	strncpy(out, snd_seq_port_info_get_name(info), cchOut);
+	return true;
+};
+
+// Takes anything snd_seq_parse_address does, such as "24:0" or "M3:0", or
+// else the name of a port.
+bool FindSequencerPort(const char* name, bool input, snd_seq_addr_t* address)
+{
+	snd_seq_t* seq = OpenSequencerClient(SND_SEQ_OPEN_OUTPUT);
+	if (seq == nullptr)
+		return false;
+
+	bool found = false;
+	snd_seq_port_info_t* info;
+	snd_seq_port_info_alloca(&info);
+	if (snd_seq_parse_address(seq, address, name) >= 0)
+		found = snd_seq_get_any_port_info(seq, address->client, address->port, info) >= 0
+			&& IsUsableSequencerPort(info, input);
+	else
+	{
+		int client = -1;
+		int port = -1;
+		char portName[64];
+		while (!found && NextSequencerPort(seq, &client, &port, input))
+		{
+			if (GetSequencerPortName(seq, client, port, portName, sizeof(portName)) && strcmp(portName, name) == 0)
+			{
+				address->client = (unsigned char)client;
+				address->port = (unsigned char)port;
+				found = true;
+			}
+		}
+	}
+	snd_seq_close(seq);
+	return found;
+};
+
+size_t GetSequencerPortCount(bool input)
+{
+	snd_seq_t* seq = OpenSequencerClient(SND_SEQ_OPEN_OUTPUT);
+	if (seq == nullptr)
+		return 0;
+
+	size_t count = 0;
+	int client = -1;
+	int port = -1;
+	while (NextSequencerPort(seq, &client, &port, input))
+		++count;
+	snd_seq_close(seq);
+	return count;
+};
+
+// The port with the given index in NextSequencerPort's order.
+bool GetSequencerPortAt(size_t index, bool input, snd_seq_addr_t* address, char* name, size_t cchName)
+{
+	snd_seq_t* seq = OpenSequencerClient(SND_SEQ_OPEN_OUTPUT);
+	if (seq == nullptr)
+		return false;
+
+	bool found = false;
+	int client = -1;
+	int port = -1;
+	while (NextSequencerPort(seq, &client, &port, input))
+	{
+		if (index-- == 0)
+		{
+			address->client = (unsigned char)client;
+			address->port = (unsigned char)port;
+			found = GetSequencerPortName(seq, client, port, name, cchName);
+			break;
+		}
+	}
+	snd_seq_close(seq);
+	return found;
+};
+
+bool GetLoopbackName(size_t index, char* out, size_t cchOut)
+{
+	Loopback* link = Loopback::At(index);
+	if (link == nullptr)
+		return false;
+	snprintf(out, cchOut, "%s", link->Name());
+	return true;
+};
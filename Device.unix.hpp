@@ -3,4 +3,6 @@ struct DeviceEnumerator
 {
 	int card, device, subdevice, nSubdevices;
 	void* ctl;
+	// Next entry of the device registry to visit.
+	size_t index;
 };
@@ -0,0 +1,165 @@
+#include "Discovery.hpp"
+#include "Event.hpp"
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// An identity reply: F0 7E <channel> 06 02 <manufacturer> <family:2>
+// <member:2> <version:4> F7, with the two-byte fields least significant first.
+static constexpr size_t IdentityReplySize { 15 };
+
+struct ProbeSet;
+
+struct Probe
+{
+	ProbeSet* Set;
+	int ID;
+	InputDevice* Input;
+	// The SysEx arriving on this input, which may come in pieces.
+	uint8_t Reply[IdentityReplySize];
+	size_t cbReply = 0;
+};
+
+struct ProbeSet
+{
+	std::mutex Lock;
+	Event Answered;
+	Probe* Found = nullptr;
+	uint8_t Identity[IdentityReplySize];
+};
+
+static bool IsM3Identity(const uint8_t* reply, size_t cbReply)
+{
+	return cbReply == IdentityReplySize && reply[1] == 0x7E && reply[3] == 0x06 && reply[4] == 0x02
+		&& reply[5] == KorgManufacturerID && (reply[6] | (reply[7] << 7)) == M3FamilyID
+		&& reply[IdentityReplySize - 1] == 0xF7;
+};
+
+static void OnProbeReceived(void* context, [[maybe_unused]] void* sender, MIDIEventArgs& e)
+{
+	if (e.Message.Status != 0xF0 || e.Message.BufferSize == 0)
+		return;
+
+	Probe* probe = (Probe*)context;
+	const uint8_t* data = e.Message.Buffer;
+	size_t cbData = e.Message.BufferSize;
+	if (data[0] == 0xF0)
+		probe->cbReply = 0;
+	else if (probe->cbReply == 0)
+		return;
+
+	// Anything longer than an identity reply isn't one.
+	if (cbData > IdentityReplySize - probe->cbReply)
+	{
+		probe->cbReply = 0;
+		return;
+	}
+	memcpy(&probe->Reply[probe->cbReply], data, cbData);
+	probe->cbReply += cbData;
+	if (probe->Reply[probe->cbReply - 1] != 0xF7)
+		return;
+
+	bool found = IsM3Identity(probe->Reply, probe->cbReply);
+	probe->cbReply = 0;
+	if (!found)
+		return;
+
+	std::lock_guard<std::mutex> lock(probe->Set->Lock);
+	if (probe->Set->Found == nullptr)
+	{
+		probe->Set->Found = probe;
+		memcpy(probe->Set->Identity, probe->Reply, IdentityReplySize);
+		probe->Set->Answered.Signal();
+	}
+};
+
+bool DiscoverM3(DiscoveredDevice* found, uint32_t timeout)
+{
+	// Every port is opened before anything is sent, so the replies all come
+	// back within the same round trip.
+	ProbeSet probes;
+	std::vector<std::unique_ptr<Probe>> inputs;
+	std::vector<std::pair<int, OutputDevice*>> outputs;
+	size_t nInputs = InputDevice::Count();
+	size_t nOutputs = OutputDevice::Count();
+	for (size_t id = 0; id < nInputs; ++id)
+	{
+		InputDevice* input = InputDevice::GetByID((int)id);
+		if (input == nullptr)
+			continue;
+		if (!input->Open())
+		{
+			delete input;
+			continue;
+		}
+		inputs.emplace_back(new Probe { &probes, (int)id, input, {}, 0 });
+		input->AddCallback(OnProbeReceived, inputs.back().get(), MessageFilter().Add(SystemMessageType::SysExStart));
+	}
+	for (size_t id = 0; id < nOutputs; ++id)
+	{
+		OutputDevice* output = OutputDevice::GetByID((int)id);
+		if (output == nullptr)
+			continue;
+		if (!output->Open())
+		{
+			delete output;
+			continue;
+		}
+		outputs.emplace_back((int)id, output);
+	}
+
+	for (auto& output : outputs)
+		output.second->LongMessage(IdentityRequest, sizeof(IdentityRequest));
+	probes.Answered.WaitFor(timeout);
+
+	for (auto& probe : inputs)
+		probe->Input->RemoveCallback(OnProbeReceived, probe.get());
+
+	// The answer came in on Found; go out through the output most like it.
+	Probe* answered;
+	{
+		std::lock_guard<std::mutex> lock(probes.Lock);
+		answered = probes.Found;
+	}
+	int bestAffinity = 0;
+	OutputDevice* output = nullptr;
+	int outputId = -1;
+	if (answered)
+	{
+		for (auto& candidate : outputs)
+		{
+			int affinity = PortAffinity(answered->ID, candidate.first);
+			if (affinity > bestAffinity)
+			{
+				bestAffinity = affinity;
+				output = candidate.second;
+				outputId = candidate.first;
+			}
+		}
+	}
+
+	for (auto& probe : inputs)
+		if (output == nullptr || probe.get() != answered)
+			delete probe->Input;
+	for (auto& candidate : outputs)
+		if (candidate.second != output)
+			delete candidate.second;
+	if (output == nullptr)
+		return false;
+
+	char name[32];
+	found->Input = answered->Input;
+	found->Output = output;
+	found->InputName = InputDevice::GetName(answered->ID, name) ? name : "";
+	found->OutputName = OutputDevice::GetName(outputId, name) ? name : "";
+	found->Member = (uint16_t)(probes.Identity[8] | (probes.Identity[9] << 7));
+	memcpy(found->Version, &probes.Identity[10], sizeof(found->Version));
+	return true;
+};
+
+#ifdef _WIN32
+#include "Discovery.win32.cpp"
+#else
+#include "Discovery.unix.cpp"
+#endif
@@ -0,0 +1,33 @@
+#pragma once
+#include "InputDevice.hpp"
+#include "OutputDevice.hpp"
+#include <string>
+
+// Universal SysEx identity request, sent to every device (ID 7Fh).
+static constexpr uint8_t IdentityRequest[] { 0xF0, 0x7E, 0x7F, 0x06, 0x01, 0xF7 };
+static constexpr uint8_t KorgManufacturerID { 0x42 };
+static constexpr uint16_t M3FamilyID        { 0x0075 };
+// How long to wait for replies. Every port is asked at once, so this only
+// needs to cover one round trip.
+static constexpr uint32_t DiscoveryTimeout  { 500 };
+
+struct DiscoveredDevice
+{
+	InputDevice* Input = nullptr;
+	OutputDevice* Output = nullptr;
+	// As GetName(int) has them, to find the ports again next time.
+	std::string InputName;
+	std::string OutputName;
+	uint16_t Member = 0;
+	uint8_t Version[4] {};
+};
+
+// Opens every input and output, sends the identity request on all the outputs
+// at once and waits for an M3 to answer on one of the inputs. The output it
+// was reached through is taken to be the one of the same device as that input.
+// On success the pair is left open in *found; every other port is closed.
+bool DiscoverM3(DiscoveredDevice* found, uint32_t timeout = DiscoveryTimeout);
+
+// How sure we are an input and an output are ports of the same device: 0 if
+// they aren't, higher for a closer match.
+int PortAffinity(int inputId, int outputId);
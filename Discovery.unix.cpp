@@ -0,0 +1,29 @@
+#include "Discovery.hpp"
+#include <alsa/asoundlib.h>
+
+#include "Device.unix.inc"
+
+// Ports of one card, or one sequencer client, belong to the same device, and
+// the output with the same device and subdevice numbers as the input is the
+// other half of its port.
+int PortAffinity(int inputId, int outputId)
+{
+	if (Device::Backend() == DeviceBackend::Sequencer)
+	{
+		snd_seq_addr_t input, output;
+		char name[64];
+		if (!GetSequencerPortAt((size_t)inputId, true, &input, name, sizeof(name))
+			|| !GetSequencerPortAt((size_t)outputId, false, &output, name, sizeof(name)))
+			return 0;
+		return input.client != output.client ? 0 : input.port == output.port ? 2 : 1;
+	}
+	// Each loopback is one connection, listed in the same order both ways.
+	if (Device::Backend() == DeviceBackend::Loopback)
+		return inputId == outputId ? 2 : 0;
+
+	DeviceEntry input, output;
+	if (!Devices().At(true, (size_t)inputId, &input) || !Devices().At(false, (size_t)outputId, &output)
+		|| input.Card != output.Card)
+		return 0;
+	return input.Device == output.Device && input.Subdevice == output.Subdevice ? 2 : 1;
+};
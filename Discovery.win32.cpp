@@ -0,0 +1,19 @@
+#include "Discovery.hpp"
+
+// WinMM gives nothing but names, and the ports of one device are named after
+// it, such as "M3 1 KEYBOARD" and "M3 1 SOUND": the longer the name they
+// start with, the likelier they belong together.
+int PortAffinity(int inputId, int outputId)
+{
+	char input[32], output[32];
+	if (!InputDevice::GetName(inputId, input) || !OutputDevice::GetName(outputId, output))
+		return 0;
+
+	int common = 0;
+	while (input[common] && input[common] == output[common])
+		++common;
+	// Only count whole words.
+	while (common > 0 && input[common - 1] != ' ' && (input[common] || output[common]))
+		--common;
+	return common;
+};
@@ -1,16 +1,25 @@
 #pragma once
+#include <cstdint>
 #ifdef _WIN32
 #include "Event.win32.hpp"
 #else
 #include "Event.unix.hpp"
 #endif
+// Auto-reset: a Signal releases one Wait, and a Signal with nobody waiting is
+// held until the next Wait, which then returns immediately.
 class Event
 {
 private:
 	EventImpl m_handle;
 public:
-	Event(const char* name);
+	Event();
+	Event(const Event&) = delete;
+	Event& operator=(const Event&) = delete;
 	~Event();
 	void Wait();
+	// Returns false if the event wasn't signalled within the timeout.
+	bool WaitFor(uint32_t milliseconds);
 	void Signal();
+	// Drops a Signal nobody has waited for yet.
+	void Reset();
 };
@@ -1,30 +1,80 @@
 #include "Event.hpp"
-#include <fcntl.h>
-#include <sys/stat.h>
-#include <limits.h>
-#include <cstdio>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <chrono>
+#include <ctime>
 
-Event::Event(const char* name)
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex word must be a plain 32-bit integer");
+
+// Sleeps while *word is still 0. A null timeout waits forever.
+static void FutexWait(std::atomic<uint32_t>* word, const struct timespec* timeout)
 {
-	char newName[NAME_MAX-4];
-	snprintf(newName, NAME_MAX-4, "/%s", name);
-	m_handle = sem_open(newName, O_CREAT | O_EXCL, O_RDWR, 0u);
+	syscall(SYS_futex, (uint32_t*)word, FUTEX_WAIT_PRIVATE, 0u, timeout, nullptr, 0);
 };
 
-Event::~Event()
+static void FutexWake(std::atomic<uint32_t>* word)
+{
+	syscall(SYS_futex, (uint32_t*)word, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+};
+
+// Takes the signal if there is one.
+static inline bool TryConsume(EventImpl& handle)
 {
-	sem_close(m_handle);
-	m_handle = nullptr;
+	uint32_t expected = 1;
+	return handle.State.compare_exchange_strong(expected, 0, std::memory_order_acquire, std::memory_order_relaxed);
 };
 
+Event::Event()
+{ };
+
+Event::~Event()
+{ };
+
 void Event::Wait()
 {
-	sem_wait(m_handle);
+	if (TryConsume(m_handle))
+		return;
+
+	m_handle.Waiters.fetch_add(1);
+	while (!TryConsume(m_handle))
+		FutexWait(&m_handle.State, nullptr);
+	m_handle.Waiters.fetch_sub(1);
 };
 
-void Event::Signal()
+bool Event::WaitFor(uint32_t milliseconds)
 {
-	sem_post(m_handle);
+	if (TryConsume(m_handle))
+		return true;
+	if (milliseconds == 0)
+		return false;
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(milliseconds);
+	bool signalled = false;
+	m_handle.Waiters.fetch_add(1);
+	while (!(signalled = TryConsume(m_handle)))
+	{
+		auto remaining = deadline - std::chrono::steady_clock::now();
+		if (remaining <= std::chrono::nanoseconds::zero())
+			break;
+		auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(remaining).count();
+		struct timespec timeout { (time_t)(ns / 1000000000), (long)(ns % 1000000000) };
+		FutexWait(&m_handle.State, &timeout);
+	}
+	m_handle.Waiters.fetch_sub(1);
+	return signalled;
 };
 
+void Event::Signal()
+{
+	// Both sides are sequentially consistent, so either a waiter that's about to
+	// sleep sees State == 1 and doesn't, or we see it in Waiters and wake it.
+	m_handle.State.store(1);
+	if (m_handle.Waiters.load() != 0)
+		FutexWake(&m_handle.State);
+};
 
+void Event::Reset()
+{
+	m_handle.State.store(0, std::memory_order_relaxed);
+};
@@ -1,3 +1,9 @@
 #pragma once
-#include <semaphore.h>
-typedef sem_t* EventImpl;
+#include <atomic>
+#include <cstdint>
+struct EventImpl
+{
+	// 1 when signalled. A futex word, so it has to be exactly 32 bits.
+	std::atomic<uint32_t> State { 0 };
+	std::atomic<uint32_t> Waiters { 0 };
+};
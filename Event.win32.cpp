@@ -1,7 +1,7 @@
 #include "Event.hpp"
 
-Event::Event(const char* name)
-	: m_handle(CreateEvent(NULL, FALSE, FALSE, name))
+Event::Event()
+	: m_handle(CreateEvent(NULL, FALSE, FALSE, NULL))
 { };
 
 Event::~Event()
@@ -15,9 +15,18 @@ void Event::Wait()
 	WaitForSingleObject(m_handle, INFINITE);
 };
 
+bool Event::WaitFor(uint32_t milliseconds)
+{
+	return WaitForSingleObject(m_handle, milliseconds) == WAIT_OBJECT_0;
+};
+
 void Event::Signal()
 {
 	SetEvent(m_handle);
 };
 
+void Event::Reset()
+{
+	ResetEvent(m_handle);
+};
 
@@ -1,5 +1,6 @@
 #include "InputDevice.hpp"
 #include <list>
+#include <thread>
 
 #ifdef _MSC_VER
 #define strncasecmp _strnicmp
@@ -8,85 +9,144 @@
 InputDevice::InputDevice(ImplType* impl)
 	: m_impl(impl) { };
 
-void InputDevice::OnMessageReceived(MIDIEventArgs* e)
+// The list the current thread is dispatching for, so a callback removing
+// itself doesn't wait for its own pass to end.
+static thread_local const CallbackList* t_dispatching = nullptr;
+
+CallbackList::~CallbackList()
+{
+	delete m_current.load();
+	for (const auto& retired : m_retired)
+		delete retired.first;
+};
+
+void CallbackList::Dispatch(void* sender, MIDIEventArgs& e)
 {
-#if 0
-	if (enableThreadSync)
+	const CallbackList* outer = t_dispatching;
+	t_dispatching = this;
+	// Only the first piece of a SysEx starts with F0h.
+	const Message& message = e.Message;
+	unsigned bit;
+	if (message.Status == 0xF0 && (message.BufferSize == 0 || message.Buffer[0] != 0xF0))
+		bit = m_sysexBit;
+	else if (message.Status == 0xF0)
+		bit = m_sysexBit = MessageFilter::BitOf(message);
+	else
+		bit = MessageFilter::BitOf(message);
+
+	m_passes.fetch_add(1);
+	if (const Snapshot* callbacks = m_current.load())
 	{
-		if (locked)
-			wait->WaitOne();
-		locked = true;
-		for each (MIDIEvent var in _callbacks)
+		for (const auto& callback : *callbacks)
 		{
-			if (var.Key == MIDIMessage::InputData) var.Value(this, e);
+			if (callback.Filter.Test(bit))
+				callback.Handler(callback.Context, sender, e);
 		}
-		locked = false;
-		wait->Set();
 	}
-	else
-#endif
+	m_passes.fetch_add(1);
+	t_dispatching = outer;
+
+	// Snapshots replaced during the pass. Left for the writer if it's busy.
+	if (m_hasRetired.load(std::memory_order_relaxed) && m_lock.try_lock())
 	{
-		for (auto& callback : m_callbacks)
-		{
-			callback.second(callback.first, this, *e);
-		}
+		FreeRetired();
+		m_lock.unlock();
 	}
 };
 
-void InputDevice::AddCallback(MIDIEventHandler callback, void* context)
+void CallbackList::Add(MIDIEventHandler callback, void* context, const MessageFilter& filter)
 {
-	m_callbacks.emplace_back(context, callback);
+	uint64_t pass;
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		const Snapshot* current = m_current.load(std::memory_order_relaxed);
+		Snapshot* next = current != nullptr ? new Snapshot(*current) : new Snapshot();
+		next->push_back(MIDIEvent { context, callback, filter });
+		pass = Publish(next, true);
+	}
+	Synchronise(pass);
 };
 
-bool InputDevice::RemoveCallback(MIDIEventHandler callback, void* context)
+uint64_t CallbackList::Publish(Snapshot* next, bool changed)
 {
-	for (int i = m_callbacks.size() - 1; i >= 0; --i)
+	if (!changed)
 	{
-		const auto& item = m_callbacks[i];
-		if (item.first == context && item.second == callback)
-		{
-			m_callbacks.erase(m_callbacks.cbegin() + i);
-			return true;
-		}
+		delete next;
+		return 0;
 	}
-	return false;
+
+	// A pass that starts from here on reads next, so the old snapshot is only
+	// in use until the one running now, if any, is over.
+	Snapshot* previous = m_current.exchange(next);
+	uint64_t pass = m_passes.load();
+	if (previous == nullptr)
+		return 0;
+	if ((pass & 1) == 0)
+	{
+		delete previous;
+		return pass;
+	}
+	m_retired.emplace_back(previous, pass);
+	m_hasRetired.store(true, std::memory_order_relaxed);
+	return pass;
 };
 
-bool InputDevice::RemoveCallbacks(void* context)
+void CallbackList::Synchronise(uint64_t pass)
+{
+	// The dispatch thread changing the list from a callback can't wait for its
+	// own pass; it frees what it retired once the pass ends.
+	if ((pass & 1) == 0 || t_dispatching == this)
+		return;
+	while (m_passes.load() == pass)
+		std::this_thread::yield();
+
+	std::lock_guard<std::mutex> lock(m_lock);
+	FreeRetired();
+};
+
+void CallbackList::FreeRetired()
 {
-	bool hasDeleted = false;
-	for (int i = m_callbacks.size() - 1; i >= 0; --i)
+	uint64_t now = m_passes.load();
+	size_t kept = 0;
+	for (const auto& retired : m_retired)
 	{
-		const auto& item = m_callbacks[i];
-		if (item.first == context)
-		{
-			m_callbacks.erase(m_callbacks.cbegin() + i);
-			hasDeleted = true;
-		}
+		if (retired.second != now)
+			delete retired.first;
+		else
+			m_retired[kept++] = retired;
 	}
-	return hasDeleted;
+	m_retired.resize(kept);
+	m_hasRetired.store(kept != 0, std::memory_order_relaxed);
+};
+
+void InputDevice::OnMessageReceived(MIDIEventArgs* e)
+{
+	m_callbacks.Dispatch(this, *e);
+};
+
+void InputDevice::AddCallback(MIDIEventHandler callback, void* context, const MessageFilter& filter)
+{
+	m_callbacks.Add(callback, context, filter);
+};
+
+bool InputDevice::RemoveCallback(MIDIEventHandler callback, void* context)
+{
+	return m_callbacks.Remove([=](const MIDIEvent& item) { return item.Context == context && item.Handler == callback; }, true);
+};
+
+bool InputDevice::RemoveCallbacks(void* context)
+{
+	return m_callbacks.Remove([=](const MIDIEvent& item) { return item.Context == context; }, false);
 };
 
 bool InputDevice::RemoveCallbacks(MIDIEventHandler callback)
 {
-	bool hasDeleted = false;
-	for (int i = m_callbacks.size() - 1; i >= 0; --i)
-	{
-		const auto& item = m_callbacks[i];
-		if (item.second == callback)
-		{
-			m_callbacks.erase(m_callbacks.cbegin() + i);
-			hasDeleted = true;
-		}
-	}
-	return hasDeleted;
+	return m_callbacks.Remove([=](const MIDIEvent& item) { return item.Handler == callback; }, false);
 };
 
 bool InputDevice::RemoveCallbacks()
 {
-	bool hasDeleted = !m_callbacks.empty();
-	m_callbacks.clear();
-	return hasDeleted;
+	return m_callbacks.Remove([](const MIDIEvent&) { return true; }, false);
 };
 
 #ifdef _WIN32
@@ -1,5 +1,8 @@
 #pragma once
 #include "Device.hpp"
+#include <atomic>
+#include <mutex>
+#include <vector>
 
 //#ifdef _WIN33
 //#include "InputDevice.win32.hpp"
@@ -8,18 +11,108 @@
 //#endif
 
 struct InputDeviceEnumerator;
+
+struct InputStatistics
+{
+	size_t QueueSize;      // Slots between the reader and the dispatch thread
+	size_t QueueHighWater; // Most slots ever in use at once
+	size_t ReaderStalls;   // Times the reader found every slot in use and waited; nothing is lost
+};
+
+// The callbacks of an input, read-copy-update style. Dispatch walks a
+// snapshot without taking a lock; adding or removing one publishes a changed
+// copy. A snapshot that is replaced while a pass is walking it lives until
+// that pass ends, so a callback removed mid-pass may still be called in it.
+//
+// Removing from any thread but the one dispatching waits for the pass in
+// progress to finish, after which the callback's context may be freed.
+// Assumes one thread dispatches for a device at a time.
+class CallbackList
+{
+private:
+	typedef std::vector<MIDIEvent> Snapshot;
+	std::atomic<Snapshot*> m_current { nullptr };
+	// Odd while a pass is running.
+	std::atomic<uint64_t> m_passes { 0 };
+	std::mutex m_lock;
+	// Replaced snapshots, with the pass that may still be reading each.
+	std::vector<std::pair<Snapshot*, uint64_t>> m_retired;
+	std::atomic<bool> m_hasRetired { false };
+	// What the SysEx arriving counts as, for its later pieces. Only touched
+	// by the dispatch thread.
+	unsigned m_sysexBit = 0;
+
+	// Under m_lock. Makes next current if changed, else throws it away. Returns
+	// the pass to wait for before the old snapshot can go, or an even number
+	// if none was running.
+	uint64_t Publish(Snapshot* next, bool changed);
+	// Not under m_lock, so callbacks of the pass waited for can still change
+	// the list.
+	void Synchronise(uint64_t pass);
+	// Under m_lock.
+	void FreeRetired();
+public:
+	CallbackList() = default;
+	CallbackList(const CallbackList&) = delete;
+	CallbackList& operator=(const CallbackList&) = delete;
+	~CallbackList();
+	void Dispatch(void* sender, MIDIEventArgs& e);
+	void Add(MIDIEventHandler callback, void* context, const MessageFilter& filter);
+	// Removes the callbacks match returns true for, or only the last added of
+	// them if one is set.
+	template <class Predicate>
+	bool Remove(Predicate match, bool one)
+	{
+		bool removed = false;
+		uint64_t pass;
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			const Snapshot* current = m_current.load(std::memory_order_relaxed);
+			if (current == nullptr)
+				return false;
+			Snapshot* next = new Snapshot(*current);
+			for (size_t i = next->size(); i-- > 0;)
+			{
+				if (match((*next)[i]))
+				{
+					next->erase(next->begin() + i);
+					removed = true;
+					if (one)
+						break;
+				}
+			}
+			pass = Publish(next, removed);
+		}
+		Synchronise(pass);
+		return removed;
+	};
+};
+
 class InputDevice : public Device
 {
 private:
 	struct ImplType;
 	InputDevice(ImplType* impl);
 	ImplType* m_impl;
-	std::vector<MIDIEvent> m_callbacks;
+	CallbackList m_callbacks;
+#ifndef _WIN32
+	bool OpenRawMidi();
+	bool OpenSequencer();
+	bool OpenLoopback();
+	bool CloseHandles();
+	void ReadLoop();
+	void SequencerReadLoop();
+	void DispatchLoop();
+	static void ParsedMessage(void* context, const Message& message);
+#endif
 public:
 	static bool EnumerateNext(DeviceEnumerator*);
 	static void StopEnumeration(DeviceEnumerator*);
 	static bool GetName(const DeviceEnumerator*, char* out, size_t cchOut);
 	static InputDevice* GetByName(const char* name);
+	// As GetByName, trying the address the device had last time before looking
+	// for it, which saves enumerating devices if it's still there.
+	static InputDevice* GetByName(const char* name, const char* lastAddress);
 	static InputDevice* GetByID(int id);
 	static bool GetName(int id, char* out);
 	static size_t Count();
@@ -28,11 +121,13 @@ public:
 	virtual bool Close() override;
 	virtual const char* Name() const override;
 	void StartReceiveDump(size_t size/*BufferCallback^ callback*/);
-	void AddCallback(MIDIEventHandler callback, void* context = nullptr);
+	// Only messages filter passes are handed to callback.
+	void AddCallback(MIDIEventHandler callback, void* context = nullptr, const MessageFilter& filter = MessageFilter::All());
 	bool RemoveCallback(MIDIEventHandler callback, void* context);
 	bool RemoveCallbacks(MIDIEventHandler callback);
 	bool RemoveCallbacks(void* context);
 	bool RemoveCallbacks();
+	bool GetStatistics(InputStatistics* out) const;
 private:
 	void OnMessageReceived(MIDIEventArgs* e);
 protected:
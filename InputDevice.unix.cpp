@@ -1,17 +1,65 @@
 #include "InputDevice.hpp"
+#include "MidiParser.hpp"
+#include "SpscRing.hpp"
+#include "Loopback.hpp"
 #include <alsa/asoundlib.h>
 #include <linux/soundcard.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <chrono>
+#include <thread>
 
 #include "Device.unix.inc"
 
+// Size of each snd_rawmidi_read, and of the kernel-side receive buffer. A
+// combi dump is several kilobytes, so read it in as few syscalls as possible
+// and give the kernel enough room to hold on to it if we're slow.
+static constexpr size_t ReadChunkSize    { 4096 };
+static constexpr size_t KernelBufferSize { 64 * 1024 };
+// Reads queued between the reader and the dispatch thread. 64 x 4 KB covers a
+// whole bank dump arriving while a callback is busy printing.
+static constexpr size_t ReadQueueSize    { 64 };
+// Sequencer backend: events the kernel holds for us, and the bytes of events
+// each read() brings in. The M3's SysEx arrives as events of 256 bytes at most.
+static constexpr size_t SequencerInputPool  { 2000 };
+static constexpr size_t SequencerBufferSize { 64 * 1024 };
+
+struct InputBlock
+{
+	size_t Length;
+	// When the first byte of the block arrived.
+	std::chrono::steady_clock::time_point Received;
+	uint8_t Data[ReadChunkSize];
+};
+
 struct InputDevice::ImplType
 {
 	char Name[32];
-	snd_rawmidi_t* Handle;
-	int Card, Device, Subdevice;
+	DeviceBackend Backend = DeviceBackend::RawMidi;
+	// What the device was asked for by, looked up again on each Open in case
+	// it has been unplugged and come back as another card.
+	std::string Key;
+	snd_rawmidi_t* Handle = nullptr;
+	int Card = -1, Device = -1, Subdevice = -1;
+	// Sequencer backend: a port of our own, subscribed to Source through a queue
+	// that has the kernel stamp each event with the time it arrived.
+	snd_seq_t* Seq = nullptr;
+	snd_seq_addr_t Source;
+	int TimestampQueue = -1;
+	std::chrono::steady_clock::time_point QueueStarted;
+	snd_midi_event_t* Decoder = nullptr;
+	// Loopback backend: read from Fd, which belongs to Link.
+	Loopback* Link = nullptr;
+	int Fd = -1;
+	int WakeFd = -1;
+	std::thread Reader;
+	std::thread Dispatcher;
+	// Arrival time of the block being parsed.
+	std::chrono::steady_clock::time_point Received;
+	SpscRing<InputBlock, ReadQueueSize> Queue;
 };
 
 InputDevice::~InputDevice()
@@ -23,151 +71,112 @@ InputDevice::~InputDevice()
 void InputDevice::StopEnumeration(DeviceEnumerator* i)
 {
 	if (i->ctl)
-		snd_ctl_close((snd_ctl_t*)i->ctl);
+		snd_seq_close((snd_seq_t*)i->ctl);
 	i->ctl = nullptr;
 };
 
 bool InputDevice::GetName(const DeviceEnumerator* i, char* out, size_t cchOut)
 {
-	if (i->ctl == nullptr)
-		return false;
+	if (Device::Backend() == DeviceBackend::Sequencer)
+		return i->ctl && GetSequencerPortName((snd_seq_t*)i->ctl, i->card, i->device, out, cchOut);
+	if (Device::Backend() == DeviceBackend::Loopback)
+		return i->index != 0 && GetLoopbackName(i->index - 1, out, cchOut);
 
-	snd_rawmidi_info_t* info;
-	snd_rawmidi_info_alloca(&info);
-	snd_rawmidi_info_set_device(info, i->device);
-	snd_rawmidi_info_set_stream(info, SND_RAWMIDI_STREAM_INPUT);
-	snd_rawmidi_info_set_subdevice(info, i->subdevice);
-	auto name = snd_rawmidi_info_get_subdevice_name(info);
-	strncpy(out, name, cchOut);
+	DeviceEntry entry;
+	if (i->index == 0 || !Devices().At(true, i->index - 1, &entry))
+		return false;
+	strncpy(out, entry.Name.c_str(), cchOut);
 	return true;
 };
 
 bool InputDevice::EnumerateNext(DeviceEnumerator* i)
 {
-	if (i->ctl == nullptr && i->card <= 0)
+	if (Device::Backend() == DeviceBackend::Sequencer)
 	{
-		i->card = -1;
-		goto NextCard;
+		if (i->ctl == nullptr)
+		{
+			if ((i->ctl = OpenSequencerClient(SND_SEQ_OPEN_OUTPUT)) == nullptr)
+				return false;
+			i->card = -1;
+			i->device = -1;
+		}
+		return NextSequencerPort((snd_seq_t*)i->ctl, &i->card, &i->device, true);
+	}
+	if (Device::Backend() == DeviceBackend::Loopback)
+	{
+		if (Loopback::At(i->index) == nullptr)
+			return false;
+		++i->index;
+		return true;
 	}
 
-	++i->subdevice;
-
-CheckSubdevice:
-	if (i->subdevice >= i->nSubdevices)
-		goto NextDevice;
-
-	return true;
-
-NextCard:
-	char name[32];
-	if (i->ctl)
-		snd_ctl_close((snd_ctl_t*)i->ctl);
-	i->ctl = nullptr;
-	if (snd_card_next(&i->card) <= 0 || i->card < 0)
+	DeviceEntry entry;
+	if (!Devices().At(true, i->index, &entry))
 		return false;
-	snprintf(name, 32, "hw:%d", i->card);
-	if (snd_ctl_open((snd_ctl_t**)&i->ctl, name, 0) < 0)
-		goto NextCard;
-
-	i->subdevice = 0;
-	i->nSubdevices = 0;
-	i->device = -1;
-	goto NextDevice;
-
-NextDevice:
-	i->subdevice = 0;
-	if (snd_ctl_rawmidi_next_device((snd_ctl_t*)i->ctl, &i->device) < 0 || i->device < 0)
-		goto NextCard;
-	snd_rawmidi_info_t* info;
-	snd_rawmidi_info_alloca(&info);
-	snd_rawmidi_info_set_device(info, i->device);
-	snd_rawmidi_info_set_stream(info, SND_RAWMIDI_STREAM_INPUT);
-	if (snd_ctl_rawmidi_info((snd_ctl_t*)i->ctl, info) < 0)
-		goto NextDevice;
-	i->nSubdevices = snd_rawmidi_info_get_subdevices_count(info);
-	goto CheckSubdevice;
+	i->card = entry.Card;
+	i->device = entry.Device;
+	i->subdevice = entry.Subdevice;
+	++i->index;
+	return true;
 };
 
-static void list_ports(void)
+InputDevice* InputDevice::GetByName(const char* name)
 {
-	snd_seq_client_info_t *cinfo;
-	snd_seq_port_info_t *pinfo;
-
-	snd_seq_client_info_alloca(&cinfo);
-	snd_seq_port_info_alloca(&pinfo);
-
-	puts(" Port    Client name                      Port name");
+	return GetByName(name, nullptr);
+};
 
-	snd_seq_client_info_set_client(cinfo, -1);
-	while (snd_seq_query_next_client(seq, cinfo) >= 0)
+InputDevice* InputDevice::GetByName(const char* name, const char* lastAddress)
+{
+	if (Device::Backend() == DeviceBackend::Sequencer)
 	{
-		int client = snd_seq_client_info_get_client(cinfo);
-
-		snd_seq_port_info_set_client(pinfo, client);
-		snd_seq_port_info_set_port(pinfo, -1);
-		while (snd_seq_query_next_port(seq, pinfo) >= 0)
+		snd_seq_addr_t address;
+		if (!FindSequencerPort(name, true, &address))
 		{
-			/* port must understand MIDI messages */
-			if (!(snd_seq_port_info_get_type(pinfo)
-			      & SND_SEQ_PORT_TYPE_MIDI_GENERIC))
-				continue;
-			/* we need both WRITE and SUBS_WRITE */
-			if ((snd_seq_port_info_get_capability(pinfo)
-			     & (SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE))
-			    != (SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE))
-				continue;
-			printf("%3d:%-3d  %-32.32s %s\n",
-			       snd_seq_port_info_get_client(pinfo),
-			       snd_seq_port_info_get_port(pinfo),
-			       snd_seq_client_info_get_name(cinfo),
-			       snd_seq_port_info_get_name(pinfo));
+			fprintf(stderr, "Couldn't find ALSA sequencer port '%s'\n", name);
+			return nullptr;
 		}
+		ImplType* impl = new ImplType;
+		impl->Backend = DeviceBackend::Sequencer;
+		impl->Source = address;
+		snprintf(impl->Name, sizeof(impl->Name), "seq:%d:%d", address.client, address.port);
+		return new InputDevice(impl);
+	}
+	if (Device::Backend() == DeviceBackend::Loopback)
+	{
+		Loopback* link = Loopback::Get(name);
+		if (link == nullptr)
+			return nullptr;
+		ImplType* impl = new ImplType;
+		impl->Backend = DeviceBackend::Loopback;
+		impl->Link = link;
+		snprintf(impl->Name, sizeof(impl->Name), "%s", link->Name());
+		return new InputDevice(impl);
 	}
-};
 
-InputDevice* InputDevice::GetByName(const char* name)
-{
-	// cardname:devicenum:subdevicenum
-	int status;
-	int card = -1;
-	char* cardname;
-	int device;
-	int subdevice = 0;
-	char nameIn[32];
-	char nameOut[32];
-	const char* p;
-
-	p = name + strlen(name);
-	do { --p; } while (p >= name && *p != ':');
-	subdevice = atoi(p + 1);
-	do { --p; } while (p >= name && *p != ':');
-	device = atoi(p + 1);
-	if (p > (name + 31)) p = name + 31;
-	strncpy(nameIn, name, p-name);
-	nameIn[p - name] = '\0';
-
-	if ((status = snd_card_next(&card)) < 0)
+	ImplType* impl;
+	if (lastAddress && *lastAddress)
+	{
+		// Only looked for if Open finds something else there.
+		impl = new ImplType;
+		impl->Key = name;
+		snprintf(impl->Name, sizeof(impl->Name), "%s", lastAddress);
+		return new InputDevice(impl);
+	}
+
+	// A subdevice name, or cardname:devicenum:subdevicenum
+	DeviceEntry entry;
+	if (!Devices().Find(true, name, &entry))
+	{
+		fprintf(stderr, "Couldn't find ALSA MIDI device '%s'\n", name);
 		return nullptr;
+	}
 
-	while (card >= 0)
-	{
-		if ((status = snd_card_get_name(card, &cardname)) < 0)
-			break; 
-		if (strcmp(cardname, nameIn) == 0)
-			goto GotCard;
-		++card;
-	}
-	fprintf(stderr, "Couldn't find ALSA MIDI device '%s'\n", name);
-	return nullptr;
-
-GotCard:
-	sprintf(nameOut, "hw:%d,%d,%d", card, device, subdevice);
-	ImplType* impl = new ImplType;
-	impl->Handle = nullptr;
-	impl->Card = card;
-	impl->Device = device;
-	impl->Subdevice = subdevice;
-	memcpy(impl->Name, nameOut, sizeof(nameOut));
+	impl = new ImplType;
+	impl->Key = name;
+	impl->Card = entry.Card;
+	impl->Device = entry.Device;
+	impl->Subdevice = entry.Subdevice;
+	snprintf(impl->Name, sizeof(impl->Name), "%s", entry.Address.c_str());
 	return new InputDevice(impl);
 };
 
@@ -176,41 +185,214 @@ bool InputDevice::Open()
 	if (m_isOpen)
 		return true;
 
-	snd_rawmidi_t* handle;
-	if (snd_rawmidi_open(&handle, NULL, m_impl->Name, 0) < 0)
+	bool opened;
+	switch (m_impl->Backend)
+	{
+	case DeviceBackend::Sequencer: opened = OpenSequencer(); break;
+	case DeviceBackend::Loopback:  opened = OpenLoopback(); break;
+	default:                       opened = OpenRawMidi(); break;
+	}
+	if (!opened)
+		return false;
+
+	if ((m_impl->WakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+	{
+		fprintf(stderr, "Failed to create reader wakeup for ALSA MIDI device '%s'\n", m_impl->Name);
+		CloseHandles();
+		return false;
+	}
+
+	Device::Open();
+	m_impl->Dispatcher = std::thread(&InputDevice::DispatchLoop, this);
+	m_impl->Reader = std::thread([this]
+	{
+		if (m_impl->Backend == DeviceBackend::Sequencer)
+			SequencerReadLoop();
+		else
+			ReadLoop();
+		m_impl->Queue.Close();
+	});
+	return true;
+};
+
+bool InputDevice::OpenRawMidi()
+{
+	// Where the device was last time is tried first, as if it's still there
+	// that saves walking every card.
+	snd_rawmidi_t* handle = nullptr;
+	if (snd_rawmidi_open(&handle, NULL, m_impl->Name, SND_RAWMIDI_NONBLOCK) >= 0 && !RawMidiIsNamed(handle, m_impl->Key.c_str()))
+	{
+		snd_rawmidi_close(handle);
+		handle = nullptr;
+	}
+
+	DeviceEntry entry;
+	if (handle == nullptr && Devices().Find(true, m_impl->Key.c_str(), &entry))
+		snprintf(m_impl->Name, sizeof(m_impl->Name), "%s", entry.Address.c_str());
+	if (handle == nullptr && snd_rawmidi_open(&handle, NULL, m_impl->Name, SND_RAWMIDI_NONBLOCK) < 0)
 	{
 		fprintf(stderr, "Failed to open ALSA MIDI device '%s'\n", m_impl->Name);
 		return false;
 	}
 
+	snd_rawmidi_params_t* params;
+	snd_rawmidi_params_alloca(&params);
+	if (snd_rawmidi_params_current(handle, params) < 0
+		|| snd_rawmidi_params_set_buffer_size(handle, params, KernelBufferSize) < 0
+		|| snd_rawmidi_params(handle, params) < 0)
+		fprintf(stderr, "Couldn't enlarge receive buffer for ALSA MIDI device '%s'\n", m_impl->Name);
+
 	m_impl->Handle = handle;
-	Device::Open();
 	return true;
 };
 
-bool InputDevice::Close()
+// Subscribes a port of our own to the source. Unlike opening it through
+// rawmidi, this leaves the source free for other applications to use too.
+bool InputDevice::OpenSequencer()
 {
-	if (!m_isOpen)
-		return true;
+	snd_seq_port_subscribe_t* subscription;
+	snd_seq_addr_t dest;
+	int port, queue;
 
-	if (snd_rawmidi_close(m_impl->Handle) < 0)
+	// Duplex, as starting the queue is done by sending an event.
+	if ((m_impl->Seq = OpenSequencerClient(SND_SEQ_OPEN_DUPLEX)) == nullptr)
+		return false;
+	if (snd_seq_set_client_pool_input(m_impl->Seq, SequencerInputPool) < 0
+		|| snd_seq_set_input_buffer_size(m_impl->Seq, SequencerBufferSize) < 0)
+		fprintf(stderr, "Couldn't enlarge receive buffer for ALSA sequencer port '%s'\n", m_impl->Name);
+
+	port = snd_seq_create_simple_port(m_impl->Seq, "M3 Helper input",
+		SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_NO_EXPORT,
+		SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+	if (port < 0)
+		goto Failed;
+	if ((queue = snd_seq_alloc_named_queue(m_impl->Seq, "M3 Helper input")) < 0)
+		goto Failed;
+	m_impl->TimestampQueue = queue;
+
+	dest.client = (unsigned char)snd_seq_client_id(m_impl->Seq);
+	dest.port = (unsigned char)port;
+	snd_seq_port_subscribe_alloca(&subscription);
+	snd_seq_port_subscribe_set_sender(subscription, &m_impl->Source);
+	snd_seq_port_subscribe_set_dest(subscription, &dest);
+	snd_seq_port_subscribe_set_queue(subscription, queue);
+	snd_seq_port_subscribe_set_time_update(subscription, 1);
+	snd_seq_port_subscribe_set_time_real(subscription, 1);
+	if (snd_seq_subscribe_port(m_impl->Seq, subscription) < 0)
+		goto Failed;
+
+	// Event times count from the start of the queue.
+	if (snd_seq_start_queue(m_impl->Seq, queue, nullptr) < 0 || snd_seq_drain_output(m_impl->Seq) < 0)
+		goto Failed;
+	m_impl->QueueStarted = std::chrono::steady_clock::now();
+
+	if (snd_midi_event_new(0, &m_impl->Decoder) < 0)
+		goto Failed;
+	snd_midi_event_no_status(m_impl->Decoder, 1);
+	return true;
+
+Failed:
+	fprintf(stderr, "Failed to subscribe to ALSA sequencer port '%s'\n", m_impl->Name);
+	CloseHandles();
+	return false;
+};
+
+// Whatever arrived while nothing had the loopback open is dropped, as a
+// device would have.
+bool InputDevice::OpenLoopback()
+{
+	m_impl->Link->Flush();
+	m_impl->Fd = m_impl->Link->InputFd();
+	return true;
+};
+
+bool InputDevice::CloseHandles()
+{
+	bool ok = true;
+	if (m_impl->Handle && snd_rawmidi_close(m_impl->Handle) < 0)
 	{
 		fprintf(stderr, "Failed to close ALSA MIDI device '%s'\n", m_impl->Name);
-		return false;
+		ok = false;
 	}
 	m_impl->Handle = nullptr;
+	m_impl->Fd = -1;
+
+	// Closing the client takes its port, subscription and queue with it.
+	if (m_impl->Seq && snd_seq_close(m_impl->Seq) < 0)
+	{
+		fprintf(stderr, "Failed to close ALSA sequencer port '%s'\n", m_impl->Name);
+		ok = false;
+	}
+	m_impl->Seq = nullptr;
+	m_impl->TimestampQueue = -1;
+	if (m_impl->Decoder)
+		snd_midi_event_free(m_impl->Decoder);
+	m_impl->Decoder = nullptr;
+	return ok;
+};
+
+bool InputDevice::Close()
+{
+	if (!m_isOpen)
+		return true;
+
+	// Wake the reader out of poll(), or out of waiting for the dispatcher to
+	// make room, and wait for it to finish with the handle. The dispatcher
+	// drains whatever was already read, then stops too.
+	uint64_t one = 1;
+	if (write(m_impl->WakeFd, &one, sizeof(one)) < 0)
+		fprintf(stderr, "Failed to stop reader for ALSA MIDI device '%s'\n", m_impl->Name);
+	m_impl->Queue.CancelWait();
+	if (m_impl->Reader.joinable())
+		m_impl->Reader.join();
+	if (m_impl->Dispatcher.joinable())
+		m_impl->Dispatcher.join();
+	m_impl->Queue.Reset();
+	close(m_impl->WakeFd);
+	m_impl->WakeFd = -1;
+
+	if (!CloseHandles())
+		return false;
 	Device::Close();
 	return true;
 };
 
 InputDevice* InputDevice::GetByID(int id)
 {
-	throw "not implemented";
+	if (id < 0)
+		return nullptr;
+
+	if (Device::Backend() == DeviceBackend::Sequencer)
+	{
+		snd_seq_addr_t address;
+		char name[64];
+		if (!GetSequencerPortAt((size_t)id, true, &address, name, sizeof(name)))
+			return nullptr;
+		snprintf(name, sizeof(name), "%d:%d", address.client, address.port);
+		return GetByName(name);
+	}
+	if (Device::Backend() == DeviceBackend::Loopback)
+	{
+		Loopback* link = Loopback::At((size_t)id);
+		return link ? GetByName(link->Name()) : nullptr;
+	}
+
+	// IDs are positions in the registry, which is in card, device and
+	// subdevice order, so a setup that hasn't changed numbers the same way
+	// every time.
+	DeviceEntry entry;
+	if (!Devices().At(true, (size_t)id, &entry))
+		return nullptr;
+	return GetByName(entry.Name.c_str(), entry.Address.c_str());
 };
 
 size_t InputDevice::Count()
 {
-	return GetTotalDeviceCount(true);
+	if (Device::Backend() == DeviceBackend::Sequencer)
+		return GetSequencerPortCount(true);
+	if (Device::Backend() == DeviceBackend::Loopback)
+		return Loopback::Count();
+	return Devices().Count(true);
 };
 
 const char* InputDevice::Name() const
@@ -218,33 +400,256 @@ const char* InputDevice::Name() const
 	return m_impl->Name;
 };
 
+// out has room for 32 characters, as with WinMM's device names.
 bool InputDevice::GetName(int id, char* out)
 {
-	throw "not implemented";
+	if (id < 0)
+		return false;
+
+	if (Device::Backend() == DeviceBackend::Sequencer)
+	{
+		snd_seq_addr_t address;
+		return GetSequencerPortAt((size_t)id, true, &address, out, 32);
+	}
+	if (Device::Backend() == DeviceBackend::Loopback)
+		return GetLoopbackName((size_t)id, out, 32);
+
+	DeviceEntry entry;
+	if (!Devices().At(true, (size_t)id, &entry))
+		return false;
+	snprintf(out, 32, "%s", entry.Name.c_str());
+	return true;
 };
 
-void InputDevice::StartReceiveDump(size_t size/*BufferCallback^ callback*/)
+void InputDevice::StartReceiveDump([[maybe_unused]] size_t size/*BufferCallback^ callback*/)
 {
-	if (!m_isOpen)
-		return;
-
-#if 0
-	LPMIDIHDR header = (LPMIDIHDR)malloc(sizeof(MIDIHDR)+size);
-	if (header == nullptr)
-		throw std::bad_alloc();
-
-	header->dwBufferLength  =256;
-	header->dwBytesRecorded =0;
-	header->dwFlags         =0;
-	header->dwOffset        =0;
-	header->lpData          = (LPSTR)(header+1);
-	m_impl->Headers.push_back(header);
-	Assert(::midiInPrepareHeader(m_impl->Handle, header, sizeof(MIDIHDR)), "Preparing SysEx RX Buffer");
-	Assert(::midiInAddBuffer(m_impl->Handle, header, sizeof(MIDIHDR)), "Adding SysEx RX buffer to device");
-#endif
-	throw "not implemented";
-};
-
-void InputDevice::callback(MIDIMessage msg, uintptr_t dw1, uintptr_t dw2)
+	// Nothing to do: unlike WinMM there are no buffers to hand to the driver,
+	// the reader thread started by Open() receives everything.
+};
+
+void InputDevice::ReadLoop()
+{
+	// A loopback is a pipe, read just like the rawmidi handle.
+	bool pipe = m_impl->Fd >= 0;
+	int nDescriptors = pipe ? 1 : snd_rawmidi_poll_descriptors_count(m_impl->Handle);
+	struct pollfd* fds = (struct pollfd*)alloca(sizeof(struct pollfd) * (nDescriptors + 1));
+	fds[0].fd = m_impl->WakeFd;
+	fds[0].events = POLLIN;
+	fds[0].revents = 0;
+	if (pipe)
+	{
+		fds[1].fd = m_impl->Fd;
+		fds[1].events = POLLIN;
+		fds[1].revents = 0;
+	}
+	else
+		nDescriptors = snd_rawmidi_poll_descriptors(m_impl->Handle, &fds[1], nDescriptors);
+
+	for (;;)
+	{
+		if (poll(fds, nDescriptors + 1, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Polling ALSA MIDI device '%s' failed: %s\n", m_impl->Name, strerror(errno));
+			return;
+		}
+
+		if (fds[0].revents)
+			return;
+
+		unsigned short revents = fds[1].revents;
+		if (!pipe && snd_rawmidi_poll_descriptors_revents(m_impl->Handle, &fds[1], nDescriptors, &revents) < 0)
+			continue;
+		if (revents & (POLLERR | POLLHUP))
+		{
+			fprintf(stderr, "ALSA MIDI device '%s' went away\n", m_impl->Name);
+			return;
+		}
+		if (!(revents & POLLIN))
+			continue;
+
+		// Drain everything the kernel has buffered before going back to poll(),
+		// reading straight into the dispatch queue. If that's full, leave the
+		// data with the kernel until the dispatcher catches up.
+		for (;;)
+		{
+			InputBlock* block = m_impl->Queue.Reserve();
+			if (block == nullptr)
+			{
+				if (!m_impl->Queue.WaitForSpace())
+					return;
+				continue;
+			}
+
+			ssize_t cbRead = pipe ? read(m_impl->Fd, block->Data, sizeof(block->Data)) : snd_rawmidi_read(m_impl->Handle, block->Data, sizeof(block->Data));
+			if (pipe && cbRead < 0)
+				cbRead = -errno;
+			if (cbRead == -EAGAIN)
+				break;
+			if (cbRead < 0)
+			{
+				fprintf(stderr, "Reading ALSA MIDI device '%s' failed: %s\n", m_impl->Name, snd_strerror((int)cbRead));
+				return;
+			}
+			block->Length = (size_t)cbRead;
+			block->Received = std::chrono::steady_clock::now();
+			m_impl->Queue.Commit();
+			if ((size_t)cbRead < sizeof(block->Data))
+				break;
+		}
+	}
+};
+
+void InputDevice::SequencerReadLoop()
+{
+	snd_seq_t* seq = m_impl->Seq;
+	int nDescriptors = snd_seq_poll_descriptors_count(seq, POLLIN);
+	struct pollfd* fds = (struct pollfd*)alloca(sizeof(struct pollfd) * (nDescriptors + 1));
+	fds[0].fd = m_impl->WakeFd;
+	fds[0].events = POLLIN;
+	fds[0].revents = 0;
+	nDescriptors = snd_seq_poll_descriptors(seq, &fds[1], nDescriptors, POLLIN);
+
+	// Events are turned back into the bytes rawmidi would have read, packed
+	// into blocks for the dispatcher just the same.
+	InputBlock* block = nullptr;
+	// Returns false if the device is being closed while it waits for room.
+	auto append = [&](const uint8_t* data, size_t cbData, std::chrono::steady_clock::time_point received)
+	{
+		while (cbData > 0)
+		{
+			if (block == nullptr)
+			{
+				while ((block = m_impl->Queue.Reserve()) == nullptr)
+					if (!m_impl->Queue.WaitForSpace())
+						return false;
+				block->Length = 0;
+				block->Received = received;
+			}
+			size_t cbCopy = sizeof(block->Data) - block->Length;
+			if (cbCopy > cbData)
+				cbCopy = cbData;
+			memcpy(&block->Data[block->Length], data, cbCopy);
+			block->Length += cbCopy;
+			data += cbCopy;
+			cbData -= cbCopy;
+			if (block->Length == sizeof(block->Data))
+			{
+				m_impl->Queue.Commit();
+				block = nullptr;
+			}
+		}
+		return true;
+	};
+
+	for (;;)
+	{
+		if (poll(fds, nDescriptors + 1, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Polling ALSA sequencer port '%s' failed: %s\n", m_impl->Name, strerror(errno));
+			return;
+		}
+
+		if (fds[0].revents)
+			return;
+
+		unsigned short revents;
+		if (snd_seq_poll_descriptors_revents(seq, &fds[1], nDescriptors, &revents) < 0)
+			continue;
+		if (revents & (POLLERR | POLLHUP))
+		{
+			fprintf(stderr, "ALSA sequencer port '%s' went away\n", m_impl->Name);
+			return;
+		}
+		if (!(revents & POLLIN))
+			continue;
+
+		// Each read() from the kernel brings in as many events as fit in the
+		// input buffer, which snd_seq_event_input then hands out one at a time.
+		// What a batch made is passed on before going back for the next.
+		for (;;)
+		{
+			if (block != nullptr && snd_seq_event_input_pending(seq, 0) == 0)
+			{
+				m_impl->Queue.Commit();
+				block = nullptr;
+			}
+
+			snd_seq_event_t* ev;
+			int result = snd_seq_event_input(seq, &ev);
+			if (result == -EAGAIN)
+				break;
+			if (result == -ENOSPC)
+			{
+				fprintf(stderr, "ALSA sequencer port '%s' overran, events were lost\n", m_impl->Name);
+				continue;
+			}
+			if (result < 0)
+			{
+				fprintf(stderr, "Reading ALSA sequencer port '%s' failed: %s\n", m_impl->Name, snd_strerror(result));
+				return;
+			}
+
+			// Anyone may connect to the port; only listen to the source.
+			if (ev->source.client != m_impl->Source.client || ev->source.port != m_impl->Source.port)
+				continue;
+
+			auto received = std::chrono::steady_clock::now();
+			if ((ev->flags & SND_SEQ_TIME_STAMP_MASK) == SND_SEQ_TIME_STAMP_REAL)
+				received = m_impl->QueueStarted
+					+ std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::seconds(ev->time.time.tv_sec) + std::chrono::nanoseconds(ev->time.time.tv_nsec));
+
+			bool appended = true;
+			if (ev->type == SND_SEQ_EVENT_SYSEX)
+				appended = append((const uint8_t*)ev->data.ext.ptr, ev->data.ext.len, received);
+			else
+			{
+				uint8_t bytes[16];
+				long cbBytes = snd_midi_event_decode(m_impl->Decoder, bytes, sizeof(bytes), ev);
+				if (cbBytes > 0)
+					appended = append(bytes, (size_t)cbBytes, received);
+			}
+			if (!appended)
+				return;
+		}
+	}
+};
+
+void InputDevice::DispatchLoop()
+{
+	// Messages are parsed here rather than on the reader, so SysEx spans can
+	// point straight into the queued blocks until the batch is released.
+	MidiParser parser(&InputDevice::ParsedMessage, this);
+	while (m_impl->Queue.WaitForData())
+	{
+		size_t count = m_impl->Queue.Acquire();
+		for (size_t i = 0; i < count; ++i)
+		{
+			m_impl->Received = m_impl->Queue[i].Received;
+			parser.Parse(m_impl->Queue[i].Data, m_impl->Queue[i].Length);
+		}
+		m_impl->Queue.Release(count);
+	}
+};
+
+bool InputDevice::GetStatistics(InputStatistics* out) const
+{
+	out->QueueSize      = m_impl->Queue.Size();
+	out->QueueHighWater = m_impl->Queue.HighWater();
+	out->ReaderStalls   = m_impl->Queue.Stalls();
+	return true;
+};
+
+void InputDevice::ParsedMessage(void* context, const Message& message)
+{
+	InputDevice* device = (InputDevice*)context;
+	MIDIEventArgs e(message, device->m_impl->Received);
+	device->OnMessageReceived(&e);
+};
+
+void InputDevice::callback([[maybe_unused]] MIDIMessage msg, [[maybe_unused]] uintptr_t dw1, [[maybe_unused]] uintptr_t dw2)
 {
 };
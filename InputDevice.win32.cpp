@@ -28,6 +28,12 @@ InputDevice* InputDevice::GetByName(const char* name)
 	return nullptr;
 };
 
+InputDevice* InputDevice::GetByName(const char* name, [[maybe_unused]] const char* lastAddress)
+{
+	// Looking a device up by name is already cheap with WinMM.
+	return GetByName(name);
+};
+
 InputDevice* InputDevice::GetByID(int id)
 {
 	if ((UINT)id >= ::midiInGetNumDevs())
@@ -98,10 +104,7 @@ void InputDevice::callback(MIDIMessage msg, uintptr_t dw1, uintptr_t dw2)
 				else
 	#endif
 				{
-					for (const auto& callback : m_callbacks)
-					{
-						callback.second(callback.first, this, e);
-					}
+					OnMessageReceived(&e);
 				}
 
 			}
@@ -194,6 +197,12 @@ void InputDevice::StartReceiveDump(size_t size/*BufferCallback^ callback*/)
 	Assert(::midiInAddBuffer(m_impl->Handle, header, sizeof(MIDIHDR)), "Adding SysEx RX buffer to device");
 };
 
+bool InputDevice::GetStatistics([[maybe_unused]] InputStatistics* out) const
+{
+	// WinMM delivers on its own thread; there's no queue to report on.
+	return false;
+};
+
 struct CallbackState
 {
 	HMIDIIN hDevice;
@@ -0,0 +1,196 @@
+#include "KorgCodec.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define KORGCODEC_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(KORGCODEC_SSE2) && defined(__GNUC__)
+#define KORGCODEC_AVX2
+#include <immintrin.h>
+#define AVX2_FUNCTION __attribute__((target("avx2")))
+#endif
+
+size_t KorgUnpackScalar(const uint8_t* in, size_t cbIn, uint8_t* out)
+{
+	uint8_t* start = out;
+	while (cbIn > 1)
+	{
+		uint8_t msbs = *in++;
+		size_t count = cbIn > 8 ? 7 : cbIn - 1;
+		for (size_t i = 0; i < count; ++i)
+			*out++ = in[i] | (((msbs >> i) & 1) << 7);
+		in += count;
+		cbIn -= count + 1;
+	}
+	return out - start;
+};
+
+size_t KorgPackScalar(const uint8_t* in, size_t cbIn, uint8_t* out)
+{
+	uint8_t* start = out;
+	while (cbIn > 0)
+	{
+		size_t count = cbIn > 7 ? 7 : cbIn;
+		uint8_t* msbs = out++;
+		*msbs = 0;
+		for (size_t i = 0; i < count; ++i)
+		{
+			*msbs |= (in[i] >> 7) << i;
+			*out++ = in[i] & 0x7F;
+		}
+		in += count;
+		cbIn -= count;
+	}
+	return out - start;
+};
+
+// The vector versions work on two 8-byte groups per 128-bit lane. Unpacking
+// spreads each group's MSB byte across its lane, turns it into a per-byte 80h
+// mask, then shifts the two groups' data bytes together. Packing does the
+// reverse, with movemask collecting the top bits.
+//
+// Unpacking stores two bytes past the 14 it produces per lane, and packing
+// loads two bytes past the 14 it consumes, so both stop while there's still
+// enough data left for the scalar tail to cover that.
+
+#ifdef KORGCODEC_SSE2
+static size_t UnpackSSE2(const uint8_t*& in, size_t& cbIn, uint8_t*& out)
+{
+	const __m128i bits    = _mm_setr_epi8(0, 1, 2, 4, 8, 16, 32, 64, 0, 1, 2, 4, 8, 16, 32, 64);
+	const __m128i msb     = _mm_set1_epi8((char)0x80);
+	const __m128i first   = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+	uint8_t* start = out;
+	while (cbIn >= 19)
+	{
+		__m128i data   = _mm_loadu_si128((const __m128i*)in);
+		__m128i lo     = _mm_shufflelo_epi16(_mm_unpacklo_epi8(data, data), 0);
+		__m128i hi     = _mm_shufflelo_epi16(_mm_unpackhi_epi8(data, data), 0);
+		__m128i msbs   = _mm_unpacklo_epi64(lo, hi);
+		__m128i set    = _mm_cmpeq_epi8(_mm_and_si128(msbs, bits), bits);
+		data           = _mm_or_si128(data, _mm_and_si128(set, msb));
+		__m128i result = _mm_or_si128(_mm_and_si128(_mm_srli_si128(data, 1), first), _mm_andnot_si128(first, _mm_srli_si128(data, 2)));
+		_mm_storeu_si128((__m128i*)out, result);
+		in += 16;
+		cbIn -= 16;
+		out += 14;
+	}
+	return out - start;
+};
+
+static size_t PackSSE2(const uint8_t*& in, size_t& cbIn, uint8_t*& out)
+{
+	const __m128i low7    = _mm_set1_epi8(0x7F);
+	const __m128i first   = _mm_setr_epi8(0, -1, -1, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i second  = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 0, -1, -1, -1, -1, -1, -1, -1);
+	uint8_t* start = out;
+	while (cbIn >= 16)
+	{
+		__m128i data   = _mm_loadu_si128((const __m128i*)in);
+		int msbs       = _mm_movemask_epi8(data);
+		data           = _mm_and_si128(data, low7);
+		__m128i result = _mm_or_si128(_mm_and_si128(_mm_slli_si128(data, 1), first), _mm_and_si128(_mm_slli_si128(data, 2), second));
+		_mm_storeu_si128((__m128i*)out, result);
+		out[0] = msbs & 0x7F;
+		out[8] = (msbs >> 7) & 0x7F;
+		in += 14;
+		cbIn -= 14;
+		out += 16;
+	}
+	return out - start;
+};
+#endif
+
+#ifdef KORGCODEC_AVX2
+AVX2_FUNCTION static size_t UnpackAVX2(const uint8_t*& in, size_t& cbIn, uint8_t*& out)
+{
+	const __m256i bits    = _mm256_setr_epi8(0, 1, 2, 4, 8, 16, 32, 64, 0, 1, 2, 4, 8, 16, 32, 64, 0, 1, 2, 4, 8, 16, 32, 64, 0, 1, 2, 4, 8, 16, 32, 64);
+	const __m256i msb     = _mm256_set1_epi8((char)0x80);
+	const __m256i first   = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0, 0, -1, -1, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+	uint8_t* start = out;
+	while (cbIn >= 35)
+	{
+		__m256i data   = _mm256_loadu_si256((const __m256i*)in);
+		__m256i lo     = _mm256_shufflelo_epi16(_mm256_unpacklo_epi8(data, data), 0);
+		__m256i hi     = _mm256_shufflelo_epi16(_mm256_unpackhi_epi8(data, data), 0);
+		__m256i msbs   = _mm256_unpacklo_epi64(lo, hi);
+		__m256i set    = _mm256_cmpeq_epi8(_mm256_and_si256(msbs, bits), bits);
+		data           = _mm256_or_si256(data, _mm256_and_si256(set, msb));
+		__m256i result = _mm256_or_si256(_mm256_and_si256(_mm256_srli_si256(data, 1), first), _mm256_andnot_si256(first, _mm256_srli_si256(data, 2)));
+		_mm_storeu_si128((__m128i*)out, _mm256_castsi256_si128(result));
+		_mm_storeu_si128((__m128i*)(out + 14), _mm256_extracti128_si256(result, 1));
+		in += 32;
+		cbIn -= 32;
+		out += 28;
+	}
+	return out - start;
+};
+
+AVX2_FUNCTION static size_t PackAVX2(const uint8_t*& in, size_t& cbIn, uint8_t*& out)
+{
+	const __m256i low7    = _mm256_set1_epi8(0x7F);
+	const __m256i first   = _mm256_setr_epi8(0, -1, -1, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0, 0, -1, -1, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i second  = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 0, -1, -1, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0, 0, -1, -1, -1, -1, -1, -1, -1);
+	uint8_t* start = out;
+	while (cbIn >= 30)
+	{
+		__m256i data   = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)in)), _mm_loadu_si128((const __m128i*)(in + 14)), 1);
+		uint32_t msbs  = (uint32_t)_mm256_movemask_epi8(data);
+		data           = _mm256_and_si256(data, low7);
+		__m256i result = _mm256_or_si256(_mm256_and_si256(_mm256_slli_si256(data, 1), first), _mm256_and_si256(_mm256_slli_si256(data, 2), second));
+		_mm256_storeu_si256((__m256i*)out, result);
+		out[0]  = msbs & 0x7F;
+		out[8]  = (msbs >> 7) & 0x7F;
+		out[16] = (msbs >> 16) & 0x7F;
+		out[24] = (msbs >> 23) & 0x7F;
+		in += 28;
+		cbIn -= 28;
+		out += 32;
+	}
+	return out - start;
+};
+
+static bool HasAVX2()
+{
+	static const bool hasAVX2 = __builtin_cpu_supports("avx2");
+	return hasAVX2;
+};
+#endif
+
+size_t KorgUnpack(const uint8_t* in, size_t cbIn, uint8_t* out)
+{
+	size_t cbOut = 0;
+#ifdef KORGCODEC_AVX2
+	if (HasAVX2())
+		cbOut += UnpackAVX2(in, cbIn, out);
+#endif
+#ifdef KORGCODEC_SSE2
+	cbOut += UnpackSSE2(in, cbIn, out);
+#endif
+	return cbOut + KorgUnpackScalar(in, cbIn, out);
+};
+
+size_t KorgPack(const uint8_t* in, size_t cbIn, uint8_t* out)
+{
+	size_t cbOut = 0;
+#ifdef KORGCODEC_AVX2
+	if (HasAVX2())
+		cbOut += PackAVX2(in, cbIn, out);
+#endif
+#ifdef KORGCODEC_SSE2
+	cbOut += PackSSE2(in, cbIn, out);
+#endif
+	return cbOut + KorgPackScalar(in, cbIn, out);
+};
+
+const char* KorgCodecName()
+{
+#ifdef KORGCODEC_AVX2
+	if (HasAVX2())
+		return "avx2";
+#endif
+#ifdef KORGCODEC_SSE2
+	return "sse2";
+#else
+	return "scalar";
+#endif
+};
@@ -0,0 +1,22 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+// Korg dump payloads carry 8-bit data over 7-bit MIDI: each group of up to 7
+// data bytes goes out as one byte holding their top bits (bit n for byte n)
+// followed by the bytes with their top bits cleared.
+
+constexpr size_t KorgPackedSize(size_t cbUnpacked)   { return cbUnpacked / 7 * 8 + (cbUnpacked % 7 ? cbUnpacked % 7 + 1 : 0); };
+constexpr size_t KorgUnpackedSize(size_t cbPacked)   { return cbPacked / 8 * 7 + (cbPacked % 8 ? cbPacked % 8 - 1 : 0); };
+
+// Both return the number of bytes written to out. These use SSE2, or AVX2 when
+// the CPU has it, for the bulk of the data.
+size_t KorgUnpack(const uint8_t* in, size_t cbIn, uint8_t* out);
+size_t KorgPack(const uint8_t* in, size_t cbIn, uint8_t* out);
+
+// Plain versions, for reference and benchmarking.
+size_t KorgUnpackScalar(const uint8_t* in, size_t cbIn, uint8_t* out);
+size_t KorgPackScalar(const uint8_t* in, size_t cbIn, uint8_t* out);
+
+// Which implementation KorgUnpack and KorgPack use: "avx2", "sse2" or "scalar".
+const char* KorgCodecName();
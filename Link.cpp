@@ -0,0 +1,138 @@
+#include "Link.hpp"
+#include <algorithm>
+
+Link::RequestAwaiter::RequestAwaiter(Link& link, const uint8_t* data, size_t size, uint8_t expectedFunction)
+	: m_link(link)
+{
+	m_context.Initialise(nullptr, nullptr, link.m_progress);
+	m_context.FillSimple(data, size, expectedFunction);
+	m_context.UserData = this;
+	m_context.Completed = &Link::Completed;
+};
+
+Link::RequestAwaiter::~RequestAwaiter()
+{
+	ReceiveBuffers().Release(m_buffer);
+};
+
+void Link::RequestAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+	m_handle = handle;
+	m_buffer = ReceiveBuffers().Acquire();
+	m_context.BufferIn = m_buffer;
+	m_context.cbBufferIn = BufferPool::BufferSize;
+	m_link.Send(this);
+};
+
+Reply Link::RequestAwaiter::await_resume()
+{
+	Reply reply(m_context.Status, m_buffer, m_context.rxIndex);
+	m_buffer = nullptr;
+	return reply;
+};
+
+Link::Link(class InputDevice* input, class OutputDevice* output)
+	: m_transactions(input, output)
+{ };
+
+void Link::Completed(ReceiveContext* context)
+{
+	RequestAwaiter* request = (RequestAwaiter*)context->UserData;
+	Link& link = request->m_link;
+	{
+		std::lock_guard<std::mutex> lock(link.m_lock);
+		link.m_completed.push_back(request);
+	}
+	link.m_wake.Signal();
+};
+
+void Link::Send(RequestAwaiter* request)
+{
+	request->m_context.ResetState();
+	request->m_activity = request->m_context.Activity.load(std::memory_order_relaxed);
+	m_inFlight.push_back(request);
+	m_transactions.Send(&request->m_context);
+	request->m_deadline = request->m_context.SentAt + std::chrono::milliseconds(ReplyTimeout(&request->m_context, request->m_context.Attempt));
+};
+
+void Link::Finish(RequestAwaiter* request)
+{
+	m_inFlight.erase(std::find(m_inFlight.begin(), m_inFlight.end(), request));
+
+	ReceiveStatus status = request->m_context.Status;
+	if ((status == ReceiveStatus::Timeout || status == ReceiveStatus::Error) && request->m_context.Attempt < m_retry.MaxAttempts)
+		Send(request);
+	else
+		m_ready.push_back(request->m_handle);
+};
+
+// Times out the oldest request if nothing has arrived for it in time. Replies
+// come in order, so later requests aren't expected to hear anything until it's
+// done and their clocks only start then. Returns the ms until the next check.
+uint32_t Link::CheckDeadlines()
+{
+	auto now = std::chrono::steady_clock::now();
+	RequestAwaiter* expired = nullptr;
+	for (size_t i = 0; i < m_inFlight.size(); ++i)
+	{
+		RequestAwaiter* request = m_inFlight[i];
+		uint32_t activity = request->m_context.Activity.load(std::memory_order_relaxed);
+		if (i > 0 || activity != request->m_activity)
+		{
+			request->m_activity = activity;
+			request->m_deadline = now + std::chrono::milliseconds(ReplyTimeout(&request->m_context, request->m_context.Attempt));
+		}
+		else if (now >= request->m_deadline && m_transactions.Cancel(&request->m_context))
+			expired = request;
+	}
+
+	if (expired)
+	{
+		Finish(expired);
+		return 0;
+	}
+	if (m_inFlight.empty())
+		return RoundTripEstimator::MaximumTimeout;
+	auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(m_inFlight.front()->m_deadline - now).count();
+	return wait > 0 ? (uint32_t)wait + 1 : 1;
+};
+
+void Link::Spawn(Task task)
+{
+	m_ready.push_back(task.m_handle);
+	m_tasks.push_back(std::move(task));
+};
+
+void Link::Run()
+{
+	std::vector<std::coroutine_handle<>> ready;
+	std::vector<RequestAwaiter*> completed;
+	for (;;)
+	{
+		while (!m_ready.empty())
+		{
+			ready.swap(m_ready);
+			for (auto handle : ready)
+				handle.resume();
+			ready.clear();
+		}
+
+		m_tasks.erase(std::remove_if(m_tasks.begin(), m_tasks.end(), [](const Task& task) { return task.IsDone(); }), m_tasks.end());
+		// Nothing left, or nothing that could ever be woken.
+		if (m_tasks.empty() || m_inFlight.empty())
+			break;
+
+		uint32_t timeout = CheckDeadlines();
+		if (!m_ready.empty())
+			continue;
+		m_wake.WaitFor(timeout);
+
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			completed.swap(m_completed);
+		}
+		for (RequestAwaiter* request : completed)
+			Finish(request);
+		completed.clear();
+	}
+};
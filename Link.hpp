@@ -0,0 +1,162 @@
+#pragma once
+#include "Transfer.hpp"
+#include <coroutine>
+#include <vector>
+
+class Link;
+
+// A coroutine that runs on a Link. It doesn't start until it's awaited or
+// handed to Link::Spawn/Run, and a Task awaited from another Task resumes its
+// caller directly when it finishes.
+class Task
+{
+public:
+	struct promise_type
+	{
+		std::coroutine_handle<> Continuation;
+
+		struct FinalAwaiter
+		{
+			bool await_ready() const noexcept { return false; };
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+			{
+				std::coroutine_handle<> continuation = handle.promise().Continuation;
+				return continuation ? continuation : std::noop_coroutine();
+			};
+			void await_resume() const noexcept { };
+		};
+
+		Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); };
+		std::suspend_always initial_suspend() const noexcept { return {}; };
+		FinalAwaiter final_suspend() const noexcept { return {}; };
+		void return_void() const noexcept { };
+		void unhandled_exception() const noexcept { std::terminate(); };
+	};
+private:
+	std::coroutine_handle<promise_type> m_handle;
+
+	explicit Task(std::coroutine_handle<promise_type> handle) : m_handle(handle) { };
+	friend class Link;
+public:
+	Task(Task&& other) noexcept : m_handle(other.m_handle) { other.m_handle = nullptr; };
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+	Task& operator=(Task&& other) noexcept
+	{
+		if (this != &other)
+		{
+			if (m_handle)
+				m_handle.destroy();
+			m_handle = other.m_handle;
+			other.m_handle = nullptr;
+		}
+		return *this;
+	};
+	~Task() { if (m_handle) m_handle.destroy(); };
+
+	bool IsDone() const { return !m_handle || m_handle.done(); };
+
+	bool await_ready() const noexcept { return IsDone(); };
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept
+	{
+		m_handle.promise().Continuation = caller;
+		return m_handle;
+	};
+	void await_resume() const noexcept { };
+};
+
+// A reply to a Link::Request: the whole SysEx, in a buffer from
+// ReceiveBuffers() that goes back to the pool with the Reply.
+class Reply
+{
+private:
+	uint8_t* m_buffer = nullptr;
+	size_t m_size = 0;
+	ReceiveStatus m_status = ReceiveStatus::Idle;
+public:
+	Reply(ReceiveStatus status, uint8_t* buffer, size_t size) : m_buffer(buffer), m_size(size), m_status(status) { };
+	Reply(Reply&& other) noexcept : m_buffer(other.m_buffer), m_size(other.m_size), m_status(other.m_status) { other.m_buffer = nullptr; };
+	Reply(const Reply&) = delete;
+	Reply& operator=(const Reply&) = delete;
+	Reply& operator=(Reply&& other) noexcept
+	{
+		if (this != &other)
+		{
+			ReceiveBuffers().Release(m_buffer);
+			m_buffer = other.m_buffer;
+			m_size = other.m_size;
+			m_status = other.m_status;
+			other.m_buffer = nullptr;
+		}
+		return *this;
+	};
+	~Reply() { ReceiveBuffers().Release(m_buffer); };
+
+	ReceiveStatus Status() const { return m_status; };
+	explicit operator bool() const { return m_status == ReceiveStatus::Finished; };
+	uint8_t* Data() const { return m_buffer; };
+	size_t Size() const { return m_size; };
+};
+
+// An event loop over one input/output pair, on which Tasks make requests with
+//
+//	Reply reply = co_await link.Request(request, size, 0x73);
+//
+// A waiting Task is just its suspended frame; nothing blocks until every Task
+// is waiting, and then only the thread calling Run. Requests go through a
+// TransactionTable, so several Tasks can have requests in flight at once.
+// Timeouts and retries follow RoundTrips() and the RetryPolicy, as Transact does.
+class Link
+{
+public:
+	class RequestAwaiter
+	{
+	private:
+		friend class Link;
+		Link& m_link;
+		ReceiveContext m_context;
+		uint8_t* m_buffer = nullptr;
+		std::coroutine_handle<> m_handle;
+		uint32_t m_activity = 0;
+		std::chrono::steady_clock::time_point m_deadline;
+	public:
+		RequestAwaiter(Link& link, const uint8_t* data, size_t size, uint8_t expectedFunction);
+		RequestAwaiter(const RequestAwaiter&) = delete;
+		~RequestAwaiter();
+		bool await_ready() const noexcept { return false; };
+		void await_suspend(std::coroutine_handle<> handle);
+		Reply await_resume();
+	};
+private:
+	TransactionTable m_transactions;
+	RetryPolicy m_retry;
+	ProgressCallback m_progress = nullptr;
+	std::vector<Task> m_tasks;
+	std::vector<RequestAwaiter*> m_inFlight;
+	std::vector<std::coroutine_handle<>> m_ready;
+
+	// Filled on the input thread, emptied by Run.
+	std::mutex m_lock;
+	std::vector<RequestAwaiter*> m_completed;
+	Event m_wake;
+
+	static void Completed(ReceiveContext* context);
+	void Send(RequestAwaiter* request);
+	void Finish(RequestAwaiter* request);
+	uint32_t CheckDeadlines();
+public:
+	Link(class InputDevice* input, class OutputDevice* output);
+	Link(const Link&) = delete;
+	Link& operator=(const Link&) = delete;
+
+	void SetRetryPolicy(const RetryPolicy& policy) { m_retry = policy; };
+	// Called on the input thread for every piece of every reply.
+	void SetProgress(ProgressCallback callback) { m_progress = callback; };
+	// data has to stay put until the request completes, as it's sent again on a retry.
+	RequestAwaiter Request(const uint8_t* data, size_t size, uint8_t expectedFunction) { return RequestAwaiter(*this, data, size, expectedFunction); };
+	// Queues a Task to start on the next Run.
+	void Spawn(Task task);
+	// Runs every spawned Task to completion.
+	void Run();
+	void Run(Task task) { Spawn(std::move(task)); Run(); };
+};
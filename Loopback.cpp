@@ -0,0 +1,282 @@
+#include "Loopback.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// Bytes the relay reads from the output pipe at once.
+static constexpr size_t RelayChunkSize { 4096 };
+// Room in each pipe: enough for a whole bank dump to be in flight.
+static constexpr int PipeSize { 1024 * 1024 };
+
+static std::mutex s_loopbacksLock;
+static std::vector<std::unique_ptr<Loopback>> s_loopbacks;
+
+static bool MakePipe(int fds[2])
+{
+	if (pipe2(fds, O_CLOEXEC | O_NONBLOCK) < 0)
+		return false;
+	// Only a hint; the default 64 KB still works, just with more stalls.
+	fcntl(fds[1], F_SETPIPE_SZ, PipeSize);
+	return true;
+};
+
+Loopback::Loopback(const char* name)
+	: m_name(name)
+{ };
+
+Loopback::~Loopback()
+{
+	if (m_relay.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_stopping = true;
+		}
+		Wake();
+		m_relay.join();
+	}
+	for (int fd : { m_toDevice[0], m_toDevice[1], m_toHost[0], m_toHost[1], m_wakeFd })
+		if (fd >= 0)
+			close(fd);
+};
+
+bool Loopback::Start()
+{
+	if (!MakePipe(m_toDevice) || !MakePipe(m_toHost)
+		|| (m_wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+	{
+		fprintf(stderr, "Failed to create loopback '%s': %s\n", Name(), strerror(errno));
+		return false;
+	}
+	m_relay = std::thread(&Loopback::RelayLoop, this);
+	return true;
+};
+
+Loopback* Loopback::Get(const char* name)
+{
+	std::lock_guard<std::mutex> lock(s_loopbacksLock);
+	for (const auto& loopback : s_loopbacks)
+		if (loopback->m_name == name)
+			return loopback.get();
+
+	std::unique_ptr<Loopback> loopback(new Loopback(name));
+	if (!loopback->Start())
+		return nullptr;
+	s_loopbacks.push_back(std::move(loopback));
+	return s_loopbacks.back().get();
+};
+
+// The default loopback is always there, so the backend has a device to list.
+size_t Loopback::Count()
+{
+	if (Get() == nullptr)
+		return 0;
+	std::lock_guard<std::mutex> lock(s_loopbacksLock);
+	return s_loopbacks.size();
+};
+
+Loopback* Loopback::At(size_t index)
+{
+	if (Get() == nullptr)
+		return nullptr;
+	std::lock_guard<std::mutex> lock(s_loopbacksLock);
+	return index < s_loopbacks.size() ? s_loopbacks[index].get() : nullptr;
+};
+
+void Loopback::Configure(const LoopbackSettings& settings)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_settings = settings;
+	}
+	Wake();
+};
+
+LoopbackSettings Loopback::Settings()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_settings;
+};
+
+void Loopback::Attach(LoopbackPeer* peer)
+{
+	std::lock_guard<std::mutex> delivering(m_peerLock);
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_peer = peer;
+};
+
+void Loopback::Send(const uint8_t* data, size_t cbData)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		Schedule(m_inbound, data, cbData);
+	}
+	Wake();
+};
+
+uint64_t Loopback::BytesToDevice()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_bytesToDevice;
+};
+
+uint64_t Loopback::BytesToHost()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_bytesToHost;
+};
+
+void Loopback::Flush()
+{
+	uint8_t buffer[RelayChunkSize];
+	while (read(m_toHost[0], buffer, sizeof(buffer)) > 0)
+		;
+};
+
+// Under m_lock. The chunk goes on the wire once what's ahead of it is through,
+// takes as long as its bytes need at the configured rate, and arrives the
+// latency after that.
+void Loopback::Schedule(Direction& direction, const uint8_t* data, size_t cbData)
+{
+	if (cbData == 0)
+		return;
+	auto now = std::chrono::steady_clock::now();
+	auto start = direction.Free > now ? direction.Free : now;
+	auto finish = start;
+	if (m_settings.BytesPerSecond)
+		finish += std::chrono::microseconds((int64_t)cbData * 1000000 / m_settings.BytesPerSecond);
+	direction.Free = finish;
+
+	Chunk chunk;
+	chunk.Due = finish + std::chrono::microseconds(m_settings.LatencyMicroseconds);
+	chunk.Data.assign(data, data + cbData);
+	direction.Chunks.push_back(std::move(chunk));
+};
+
+void Loopback::Wake()
+{
+	uint64_t one = 1;
+	if (write(m_wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		fprintf(stderr, "Failed to wake loopback '%s'\n", Name());
+};
+
+void Loopback::RelayLoop()
+{
+	struct pollfd fds[3];
+	fds[0].fd = m_wakeFd;
+	fds[0].events = POLLIN;
+	fds[1].fd = m_toDevice[0];
+	fds[1].events = POLLIN;
+	fds[2].fd = m_toHost[1];
+	fds[2].events = POLLOUT;
+
+	uint8_t buffer[RelayChunkSize];
+	std::unique_lock<std::mutex> lock(m_lock);
+	for (;;)
+	{
+		if (m_stopping)
+			return;
+
+		// Chunks that are due: those for the device go to the peer, or without
+		// one straight on to the input like the rest.
+		auto now = std::chrono::steady_clock::now();
+		while (!m_outbound.Chunks.empty() && m_outbound.Chunks.front().Due <= now)
+		{
+			Chunk chunk = std::move(m_outbound.Chunks.front());
+			m_outbound.Chunks.pop_front();
+			m_bytesToDevice += chunk.Data.size();
+			if (m_peer == nullptr)
+			{
+				m_inbound.Chunks.push_back(std::move(chunk));
+				continue;
+			}
+			// The peer's answers are scheduled through Send, which takes the lock.
+			// If it's detached in the meantime, what it was sent is lost with it.
+			lock.unlock();
+			{
+				std::lock_guard<std::mutex> delivering(m_peerLock);
+				if (m_peer != nullptr)
+					m_peer->Received(this, chunk.Data.data(), chunk.Data.size());
+			}
+			lock.lock();
+		}
+
+		// What the input can't take yet waits in order, as it would in a device.
+		bool blocked = false;
+		while (!m_inbound.Chunks.empty() && m_inbound.Chunks.front().Due <= now)
+		{
+			Chunk& chunk = m_inbound.Chunks.front();
+			ssize_t cbWritten = write(m_toHost[1], chunk.Data.data() + chunk.Offset, chunk.Data.size() - chunk.Offset);
+			if (cbWritten < 0)
+			{
+				if (errno != EAGAIN)
+					fprintf(stderr, "Loopback '%s' failed to deliver: %s\n", Name(), strerror(errno));
+				blocked = errno == EAGAIN;
+				if (!blocked)
+					m_inbound.Chunks.pop_front();
+				break;
+			}
+			chunk.Offset += (size_t)cbWritten;
+			m_bytesToHost += (uint64_t)cbWritten;
+			if (chunk.Offset == chunk.Data.size())
+				m_inbound.Chunks.pop_front();
+		}
+
+		// Sleep until something is written, the next chunk is due or the input
+		// has room again. Like a device's buffer, the output pipe isn't read
+		// while more than a chunk is waiting to go on the wire, so a slow link
+		// holds the writer back.
+		auto due = std::chrono::steady_clock::time_point::max();
+		if (!m_outbound.Chunks.empty())
+			due = m_outbound.Chunks.front().Due;
+		if (!blocked && !m_inbound.Chunks.empty() && m_inbound.Chunks.front().Due < due)
+			due = m_inbound.Chunks.front().Due;
+		bool reading = true;
+		if (m_settings.BytesPerSecond)
+		{
+			auto resume = m_outbound.Free - std::chrono::microseconds((int64_t)RelayChunkSize * 1000000 / m_settings.BytesPerSecond);
+			if (resume > now)
+			{
+				reading = false;
+				if (resume < due)
+					due = resume;
+			}
+		}
+		struct timespec timeout;
+		if (due != std::chrono::steady_clock::time_point::max())
+		{
+			auto wait = std::chrono::duration_cast<std::chrono::nanoseconds>(due - now).count();
+			if (wait < 0)
+				wait = 0;
+			timeout.tv_sec = (time_t)(wait / 1000000000);
+			timeout.tv_nsec = (long)(wait % 1000000000);
+		}
+		fds[1].fd = reading ? m_toDevice[0] : -1;
+		fds[2].fd = blocked ? m_toHost[1] : -1;
+		for (auto& fd : fds)
+			fd.revents = 0;
+		lock.unlock();
+
+		int result = ppoll(fds, 3, due != std::chrono::steady_clock::time_point::max() ? &timeout : nullptr, nullptr);
+		if (result < 0 && errno != EINTR)
+		{
+			fprintf(stderr, "Polling loopback '%s' failed: %s\n", Name(), strerror(errno));
+			return;
+		}
+		uint64_t count;
+		if (fds[0].revents && read(m_wakeFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+			fprintf(stderr, "Failed to clear loopback '%s' wakeup\n", Name());
+		ssize_t cbRead = 0;
+		if (fds[1].revents & POLLIN)
+			cbRead = read(m_toDevice[0], buffer, sizeof(buffer));
+
+		lock.lock();
+		if (cbRead > 0)
+			Schedule(m_outbound, buffer, (size_t)cbRead);
+	}
+};
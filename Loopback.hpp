@@ -0,0 +1,110 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// How a loopback behaves as a cable: every byte is held back by the latency,
+// and each direction carries no more than BytesPerSecond.
+struct LoopbackSettings
+{
+	uint32_t LatencyMicroseconds = 0;
+	// 0 for no limit. DIN MIDI is 3125.
+	uint32_t BytesPerSecond = 0;
+};
+
+// What sits at the far end of a loopback in place of a device. Without one,
+// whatever an output sends comes back to the input, as through a cable from
+// MIDI out to MIDI in.
+class LoopbackPeer
+{
+public:
+	virtual ~LoopbackPeer() = default;
+	// Bytes from the output, on the loopback's thread, split wherever they
+	// happened to be written. Answer with Loopback::Send.
+	virtual void Received(class Loopback* link, const uint8_t* data, size_t cbData) = 0;
+};
+
+// An in-process MIDI connection for the loopback device backend (Linux), so
+// the transfer code can be run without an M3. Outputs opened on it write into
+// one pipe and inputs read from another, through the same writer thread,
+// parser and dispatch as a real device; a thread in between delays and
+// throttles what passes from one to the other.
+//
+// Loopbacks are looked up by name, created on first use and kept until exit.
+class Loopback
+{
+public:
+	static constexpr const char* DefaultName { "loopback" };
+private:
+	struct Chunk
+	{
+		std::chrono::steady_clock::time_point Due;
+		std::vector<uint8_t> Data;
+		size_t Offset = 0;
+	};
+	struct Direction
+	{
+		std::deque<Chunk> Chunks;
+		// When the last chunk queued is all on the wire.
+		std::chrono::steady_clock::time_point Free;
+	};
+
+	std::string m_name;
+	// Output writes to m_toDevice[1]; the relay reads m_toDevice[0], and writes
+	// m_toHost[1] for inputs to read from m_toHost[0].
+	int m_toDevice[2] { -1, -1 };
+	int m_toHost[2] { -1, -1 };
+	int m_wakeFd = -1;
+	std::thread m_relay;
+	// Held while the peer is handed bytes, so it can't be detached meanwhile.
+	std::mutex m_peerLock;
+	// Guards everything below. m_peer is only changed under both.
+	std::mutex m_lock;
+	LoopbackSettings m_settings;
+	LoopbackPeer* m_peer = nullptr;
+	Direction m_outbound;
+	Direction m_inbound;
+	bool m_stopping = false;
+	uint64_t m_bytesToDevice = 0;
+	uint64_t m_bytesToHost = 0;
+
+	Loopback(const char* name);
+	bool Start();
+	void Schedule(Direction& direction, const uint8_t* data, size_t cbData);
+	void Wake();
+	void RelayLoop();
+public:
+	Loopback(const Loopback&) = delete;
+	Loopback& operator=(const Loopback&) = delete;
+	~Loopback();
+
+	// nullptr if the pipes or the thread couldn't be made.
+	static Loopback* Get(const char* name = DefaultName);
+	static size_t Count();
+	static Loopback* At(size_t index);
+
+	const char* Name() const { return m_name.c_str(); };
+	void Configure(const LoopbackSettings& settings);
+	LoopbackSettings Settings();
+	// Puts peer at the far end, or takes it away if nullptr, waiting for it to
+	// finish with any bytes it's being handed. Not to be called from the peer.
+	void Attach(LoopbackPeer* peer);
+	// Sends bytes towards the input, as the device would.
+	void Send(const uint8_t* data, size_t cbData);
+	// Bytes that have reached the device end and the input end so far.
+	uint64_t BytesToDevice();
+	uint64_t BytesToHost();
+
+	// Non-blocking ends for the device backend: the one outputs write to and
+	// the one inputs read from.
+	int OutputFd() const { return m_toDevice[1]; };
+	int InputFd() const { return m_toHost[0]; };
+	// Throws away anything waiting for an input, for one being opened.
+	void Flush();
+};
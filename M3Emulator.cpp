@@ -0,0 +1,332 @@
+#include "M3Emulator.hpp"
+#include "CombiView.hpp"
+#include "KorgCodec.hpp"
+#include "SysexBuilder.hpp"
+#include <cstdio>
+#include <cstring>
+
+// What it answers an identity request with: an M3, member 0, version 1.0.
+static constexpr uint8_t IdentityReply[] { 0xF0, 0x7E, 0x00, 0x06, 0x02, 0x42, 0x75, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0xF7 };
+
+enum class Fault
+{
+	None,
+	Drop,
+	Nak,
+	Truncate
+};
+
+M3Emulator::M3Emulator(Loopback* link, size_t cbCombi)
+	: m_link(link)
+	, m_cbCombi(cbCombi < CombiView::MinimumSize ? CombiView::MinimumSize : cbCombi)
+	, m_random(m_faults.Seed)
+{
+	m_worker = std::thread(&M3Emulator::WorkLoop, this);
+	m_link->Attach(this);
+};
+
+M3Emulator::~M3Emulator()
+{
+	m_link->Attach(nullptr);
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_stopping = true;
+	}
+	m_ready.notify_all();
+	m_worker.join();
+};
+
+void M3Emulator::SetTiming(const EmulatorTiming& timing)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_timing = timing;
+};
+
+void M3Emulator::SetFaults(const EmulatorFaults& faults)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_faults = faults;
+	m_random.seed(faults.Seed);
+};
+
+EmulatorStatistics M3Emulator::Statistics()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_statistics;
+};
+
+uint8_t M3Emulator::Mode()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_mode;
+};
+
+// Every combi starts out named after its slot, with the rest of its data a
+// pattern of the slot, so a copy can be checked for having landed where it
+// should.
+void M3Emulator::Generate(uint8_t bank, uint8_t num, uint8_t* data) const
+{
+	for (size_t i = 0; i < m_cbCombi; ++i)
+		data[i] = (uint8_t)(bank * 131 + num * 7 + i);
+
+	char name[CombiView::NameLength + 1];
+	snprintf(name, sizeof(name), "Combi %c-%c%03u", bank & 0x40 ? 'U' : 'I', 'A' + (bank & 0x3F), num);
+	memset(&data[CombiView::NameOffset], ' ', CombiView::NameLength);
+	memcpy(&data[CombiView::NameOffset], name, strlen(name));
+};
+
+M3Emulator::Bank& M3Emulator::BankAt(uint8_t bank)
+{
+	auto existing = m_banks.find(bank);
+	if (existing != m_banks.end())
+		return existing->second;
+
+	Bank& created = m_banks[bank];
+	created.Memory.resize(CombisPerBank * m_cbCombi);
+	for (size_t num = 0; num < CombisPerBank; ++num)
+		Generate(bank, (uint8_t)num, &created.Memory[num * m_cbCombi]);
+	created.Stored = created.Memory;
+	return created;
+};
+
+bool M3Emulator::GetCombi(uint8_t bank, uint8_t num, uint8_t* out)
+{
+	if (!IsValidBank(bank) || num >= CombisPerBank)
+		return false;
+	std::lock_guard<std::mutex> lock(m_lock);
+	memcpy(out, &BankAt(bank).Memory[num * m_cbCombi], m_cbCombi);
+	return true;
+};
+
+bool M3Emulator::GetStoredCombi(uint8_t bank, uint8_t num, uint8_t* out)
+{
+	if (!IsValidBank(bank) || num >= CombisPerBank)
+		return false;
+	std::lock_guard<std::mutex> lock(m_lock);
+	memcpy(out, &BankAt(bank).Stored[num * m_cbCombi], m_cbCombi);
+	return true;
+};
+
+bool M3Emulator::SetCombi(uint8_t bank, uint8_t num, const uint8_t* data)
+{
+	if (!IsValidBank(bank) || num >= CombisPerBank)
+		return false;
+	std::lock_guard<std::mutex> lock(m_lock);
+	memcpy(&BankAt(bank).Memory[num * m_cbCombi], data, m_cbCombi);
+	return true;
+};
+
+// On the loopback's thread: gathers whole SysEx messages for the worker.
+// Realtime bytes may fall anywhere, and anything else outside SysEx is
+// nothing the M3 would answer.
+void M3Emulator::Received([[maybe_unused]] Loopback* link, const uint8_t* data, size_t cbData)
+{
+	for (size_t i = 0; i < cbData; ++i)
+	{
+		uint8_t b = data[i];
+		if (b >= 0xF8)
+			continue;
+		if (b == 0xF0)
+		{
+			m_incoming.clear();
+			m_inSysex = true;
+		}
+		else if (!m_inSysex)
+			continue;
+		else if (b & 0x80 && b != 0xF7)
+		{
+			// A status byte ends the SysEx without it being complete.
+			m_inSysex = false;
+			continue;
+		}
+
+		m_incoming.push_back(b);
+		if (b == 0xF7)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_lock);
+				m_requests.push_back(std::move(m_incoming));
+			}
+			m_ready.notify_one();
+			m_incoming = {};
+			m_inSysex = false;
+		}
+	}
+};
+
+void M3Emulator::WorkLoop()
+{
+	std::unique_lock<std::mutex> lock(m_lock);
+	for (;;)
+	{
+		m_ready.wait(lock, [this] { return !m_requests.empty() || m_stopping; });
+		if (m_stopping)
+			return;
+		std::vector<uint8_t> request = std::move(m_requests.front());
+		m_requests.pop_front();
+		Handle(lock, request);
+	}
+};
+
+bool M3Emulator::Delay(std::unique_lock<std::mutex>& lock, uint64_t microseconds)
+{
+	auto until = std::chrono::steady_clock::now() + std::chrono::microseconds(microseconds);
+	return !m_ready.wait_until(lock, until, [this] { return m_stopping; });
+};
+
+std::vector<uint8_t> M3Emulator::Status(uint8_t function) const
+{
+	return { 0xF0, 0x42, 0x30, 0x75, function, 0xF7 };
+};
+
+// Called with m_lock held, which it lets go of while it waits and sends.
+void M3Emulator::Handle(std::unique_lock<std::mutex>& lock, const std::vector<uint8_t>& request)
+{
+	const uint8_t* m = request.data();
+	size_t cb = request.size();
+	++m_statistics.Requests;
+
+	// Universal identity request, to any device or to ours.
+	if (cb == 6 && m[1] == 0x7E && m[3] == 0x06 && m[4] == 0x01)
+	{
+		lock.unlock();
+		m_link->Send(IdentityReply, sizeof(IdentityReply));
+		lock.lock();
+		return;
+	}
+	if (cb < 6 || m[1] != 0x42 || (m[2] & 0xF0) != 0x30 || m[3] != 0x75)
+	{
+		++m_statistics.Ignored;
+		return;
+	}
+
+	Fault fault = Fault::None;
+	double draw = std::uniform_real_distribution<double>(0, 1)(m_random);
+	if (draw < m_faults.Drop)
+		fault = Fault::Drop;
+	else if (draw < m_faults.Drop + m_faults.Nak)
+		fault = Fault::Nak;
+	else if (draw < m_faults.Drop + m_faults.Nak + m_faults.Truncate)
+		fault = Fault::Truncate;
+
+	uint8_t function = m[4];
+	uint8_t kind = m[5];
+	uint8_t bank = cb > 6 ? m[6] : 0;
+	uint8_t num = cb > 8 ? m[8] : 0;
+	bool single = kind == 0x01 && cb >= 10;
+	bool whole = kind == 0x11 && cb >= 8;
+	bool valid = IsValidBank(bank) && num < CombisPerBank;
+	std::vector<uint8_t> reply;
+	bool isDump = false;
+
+	switch (function)
+	{
+	case 0x4E: // Mode change
+		if (!Delay(lock, m_timing.ModeChange))
+			return;
+		if (fault != Fault::Nak)
+			m_mode = kind;
+		reply = Status(FunctionDataLoadCompleted);
+		break;
+
+	case 0x72: // Combi parameter dump request
+		if (!(single || whole) || !valid)
+		{
+			reply = Status(FunctionDataLoadError);
+			break;
+		}
+		if (!Delay(lock, (uint64_t)m_timing.CombiDump * (whole ? CombisPerBank : 1)))
+			return;
+		isDump = true;
+		if (single)
+		{
+			reply.resize(SysexBuilder::CombiDumpHeaderSize + KorgPackedSize(m_cbCombi) + 1);
+			SysexBuilder(0).CombiParameterDump(reply.data(), bank, num, &BankAt(bank).Memory[num * m_cbCombi], m_cbCombi);
+		}
+		else
+		{
+			// The same guess at the layout as CombiBank makes, so this says
+			// nothing about whether it's right.
+			const std::vector<uint8_t>& memory = BankAt(bank).Memory;
+			reply = { 0xF0, 0x42, 0x30, 0x75, 0x73, 0x11, bank };
+			reply.resize(SysexBuilder::CombiBankDumpHeaderSize + KorgPackedSize(memory.size()) + 1);
+			KorgPack(memory.data(), memory.size(), &reply[SysexBuilder::CombiBankDumpHeaderSize]);
+			reply.back() = 0xF7;
+		}
+		break;
+
+	case 0x73: // Combi parameter dump, to be loaded
+	{
+		size_t cbHeader = whole ? SysexBuilder::CombiBankDumpHeaderSize : SysexBuilder::CombiDumpHeaderSize;
+		size_t cbExpected = whole ? CombisPerBank * m_cbCombi : m_cbCombi;
+		std::vector<uint8_t> unpacked;
+		if ((single || whole) && valid && cb > cbHeader)
+		{
+			unpacked.resize(KorgUnpackedSize(cb - cbHeader - 1));
+			unpacked.resize(KorgUnpack(&m[cbHeader], cb - cbHeader - 1, unpacked.data()));
+		}
+		if (!Delay(lock, (uint64_t)m_timing.CombiLoad * (whole ? CombisPerBank : 1)))
+			return;
+		if (unpacked.size() != cbExpected)
+		{
+			reply = Status(FunctionDataLoadError);
+			break;
+		}
+		if (fault != Fault::Nak)
+			memcpy(&BankAt(bank).Memory[whole ? 0 : num * m_cbCombi], unpacked.data(), cbExpected);
+		reply = Status(FunctionDataLoadCompleted);
+		break;
+	}
+
+	case 0x77: // Store combination
+	case 0x76: // Store combination bank
+	{
+		bool bankStore = function == 0x76;
+		if (!(bankStore ? whole : single) || !valid)
+		{
+			reply = Status(FunctionDataLoadError);
+			break;
+		}
+		if (!Delay(lock, bankStore ? m_timing.StoreCombinationBank : m_timing.StoreCombination))
+			return;
+		Bank& stored = BankAt(bank);
+		if (fault != Fault::Nak)
+		{
+			size_t offset = bankStore ? 0 : num * m_cbCombi;
+			size_t size = bankStore ? stored.Memory.size() : m_cbCombi;
+			memcpy(&stored.Stored[offset], &stored.Memory[offset], size);
+		}
+		reply = Status(FunctionDataLoadCompleted);
+		break;
+	}
+
+	default:
+		++m_statistics.Ignored;
+		return;
+	}
+
+	switch (fault)
+	{
+	case Fault::Drop:
+		++m_statistics.Dropped;
+		return;
+	case Fault::Nak:
+		++m_statistics.Naks;
+		reply = Status(FunctionDataLoadError);
+		break;
+	case Fault::Truncate:
+		if (isDump)
+		{
+			++m_statistics.Truncated;
+			reply.resize(1 + std::uniform_int_distribution<size_t>(0, reply.size() - 3)(m_random));
+			reply.push_back(0xF7);
+		}
+		break;
+	default:
+		break;
+	}
+
+	lock.unlock();
+	m_link->Send(reply.data(), reply.size());
+	lock.lock();
+};
@@ -0,0 +1,120 @@
+#pragma once
+#include "Loopback.hpp"
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+// How long the emulated M3 spends on each kind of request before it starts
+// answering, in microseconds. Rough figures, in proportion to each other:
+// writing to flash is what takes the time.
+struct EmulatorTiming
+{
+	uint32_t ModeChange           = 2000;
+	// Per combi, whether dumped alone or as part of a bank.
+	uint32_t CombiDump            = 3000;
+	// Per combi sent to it, alone or as part of a bank.
+	uint32_t CombiLoad            = 5000;
+	uint32_t StoreCombination     = 60000;
+	uint32_t StoreCombinationBank = 1500000;
+};
+
+// Faults injected into replies, each with the given probability. They're drawn
+// from a generator seeded with Seed, so a failing run can be repeated.
+struct EmulatorFaults
+{
+	// No reply at all.
+	double Drop = 0;
+	// The error reply in place of the one expected, and the request not done.
+	double Nak = 0;
+	// A dump cut short at some point, still ending in F7h.
+	double Truncate = 0;
+	uint32_t Seed = 1;
+};
+
+struct EmulatorStatistics
+{
+	uint64_t Requests = 0;
+	uint64_t Dropped = 0;
+	uint64_t Naks = 0;
+	uint64_t Truncated = 0;
+	// SysEx it doesn't know, which the M3 ignores too.
+	uint64_t Ignored = 0;
+};
+
+// A stand-in M3 at the far end of a loopback, answering the SysEx this tool
+// sends: ModeChange, combi dump requests (single and bank), combi dumps sent
+// to it, StoreCombination and StoreCombinationBank, and the universal identity
+// request. It holds its combi banks in memory, as the M3 holds them in RAM,
+// with a second copy standing in for flash that only the store requests
+// write to. Requests are handled one at a time in the order they arrive, as
+// the M3 does, each after its EmulatorTiming delay.
+//
+// The combi data is generated, each combi named after its slot, rather than
+// read from a PCG file.
+class M3Emulator : public LoopbackPeer
+{
+public:
+	static constexpr size_t CombisPerBank { 128 };
+	static constexpr size_t DefaultCombiSize { 1024 };
+	static constexpr uint8_t FunctionDataLoadCompleted { 0x24 };
+	static constexpr uint8_t FunctionDataLoadError { 0x26 };
+private:
+	struct Bank
+	{
+		std::vector<uint8_t> Memory;
+		std::vector<uint8_t> Stored;
+	};
+
+	Loopback* m_link;
+	const size_t m_cbCombi;
+	// The SysEx arriving, only touched on the loopback's thread.
+	std::vector<uint8_t> m_incoming;
+	bool m_inSysex = false;
+	std::thread m_worker;
+	// Guards everything below.
+	std::mutex m_lock;
+	std::condition_variable m_ready;
+	std::deque<std::vector<uint8_t>> m_requests;
+	bool m_stopping = false;
+	std::map<uint8_t, Bank> m_banks;
+	uint8_t m_mode = 0;
+	EmulatorTiming m_timing;
+	EmulatorFaults m_faults;
+	std::mt19937 m_random;
+	EmulatorStatistics m_statistics;
+
+	static bool IsValidBank(uint8_t bank) { return (bank & ~0x40) < 7; };
+	// Under m_lock.
+	Bank& BankAt(uint8_t bank);
+	void Generate(uint8_t bank, uint8_t num, uint8_t* data) const;
+
+	void WorkLoop();
+	// Waits, returning false if the emulator is being stopped meanwhile.
+	bool Delay(std::unique_lock<std::mutex>& lock, uint64_t microseconds);
+	void Handle(std::unique_lock<std::mutex>& lock, const std::vector<uint8_t>& request);
+	std::vector<uint8_t> Status(uint8_t function) const;
+public:
+	// Attaches itself to link until destroyed.
+	M3Emulator(Loopback* link, size_t cbCombi = DefaultCombiSize);
+	M3Emulator(const M3Emulator&) = delete;
+	M3Emulator& operator=(const M3Emulator&) = delete;
+	~M3Emulator();
+
+	void SetTiming(const EmulatorTiming& timing);
+	void SetFaults(const EmulatorFaults& faults);
+	EmulatorStatistics Statistics();
+	uint8_t Mode();
+	size_t CombiSize() const { return m_cbCombi; };
+
+	// The unpacked data of a combi in memory, or as last stored. out has room
+	// for CombiSize() bytes. Returns false for a bank the M3 doesn't have.
+	bool GetCombi(uint8_t bank, uint8_t num, uint8_t* out);
+	bool GetStoredCombi(uint8_t bank, uint8_t num, uint8_t* out);
+	bool SetCombi(uint8_t bank, uint8_t num, const uint8_t* data);
+
+	virtual void Received(Loopback* link, const uint8_t* data, size_t cbData) override;
+};
@@ -0,0 +1,173 @@
+#include "MidiParser.hpp"
+#include <cstring>
+
+// Number of data bytes following each status. Running status only applies to
+// channel messages; system common messages cancel it.
+static constexpr uint8_t ChannelDataLengths[8] = {2,2,2,2,1,1,2,0};
+static constexpr uint8_t SystemDataLengths[16] = {0,1,2,1,0,0,0,0,0,0,0,0,0,0,0,0};
+
+MidiParser::MidiParser(MidiParserHandler handler, void* context)
+	: m_handler(handler)
+	, m_context(context)
+{ };
+
+void MidiParser::Reset()
+{
+	m_runningStatus = 0;
+	m_cbData = 0;
+	m_cbExpected = 0;
+	m_inSysex = false;
+	m_cbHead = 0;
+};
+
+void MidiParser::EmitShort(uint8_t status, uint8_t byte1, uint8_t byte2)
+{
+	m_handler(m_context, Message((uintptr_t)status | ((uintptr_t)byte1 << 8) | ((uintptr_t)byte2 << 16)));
+};
+
+void MidiParser::EmitSysex(uint8_t* buffer, size_t cbBuffer)
+{
+	m_handler(m_context, Message(buffer, cbBuffer));
+};
+
+void MidiParser::FlushHead()
+{
+	EmitSysex(m_head, m_cbHead);
+	m_cbHead = 0;
+};
+
+void MidiParser::Parse(uint8_t* buffer, size_t cbBuffer)
+{
+	size_t i = 0;
+	size_t start = 0;
+
+	while (i < cbBuffer)
+	{
+		uint8_t b = buffer[i];
+
+		if (m_inSysex)
+		{
+			if (m_cbHead)
+			{
+				// Still collecting a header that was split by a read or a realtime byte.
+				if (b >= 0xF8)
+				{
+					EmitShort(b);
+					++i;
+					continue;
+				}
+				if ((b & 0x80) && b != 0xF7)
+				{
+					FlushHead();
+					m_inSysex = false;
+					continue;
+				}
+				m_head[m_cbHead++] = b;
+				++i;
+				if (b == 0xF7)
+				{
+					FlushHead();
+					m_inSysex = false;
+				}
+				else if (m_cbHead == SysexHeadSize)
+				{
+					FlushHead();
+					start = i;
+				}
+				continue;
+			}
+
+			while (i < cbBuffer && buffer[i] < 0x80)
+				++i;
+			if (i == cbBuffer)
+				break;
+
+			b = buffer[i];
+			if (b == 0xF7)
+			{
+				++i;
+				EmitSysex(&buffer[start], i - start);
+				m_inSysex = false;
+				continue;
+			}
+			if (i > start)
+				EmitSysex(&buffer[start], i - start);
+			if (b >= 0xF8)
+			{
+				EmitShort(b);
+				start = ++i;
+				continue;
+			}
+			// Any other status byte ends an unterminated SysEx and is parsed as usual.
+			m_inSysex = false;
+			continue;
+		}
+
+		if (b >= 0xF8)
+		{
+			EmitShort(b);
+			++i;
+			continue;
+		}
+
+		if (b == 0xF0)
+		{
+			m_runningStatus = 0;
+			m_cbData = 0;
+			m_inSysex = true;
+
+			size_t j = i + 1;
+			while (j < cbBuffer && j - i < SysexHeadSize && buffer[j] < 0x80)
+				++j;
+			if (j - i == SysexHeadSize || (j < cbBuffer && buffer[j] == 0xF7))
+			{
+				start = i;
+				i = j;
+			}
+			else
+			{
+				memcpy(m_head, &buffer[i], j - i);
+				m_cbHead = (uint8_t)(j - i);
+				i = j;
+			}
+			continue;
+		}
+
+		if (b & 0x80)
+		{
+			++i;
+			m_cbData = 0;
+			if (b < 0xF0)
+			{
+				m_runningStatus = b;
+				m_cbExpected = ChannelDataLengths[(b >> 4) - 8];
+				continue;
+			}
+
+			m_runningStatus = 0;
+			if (b == 0xF7)
+				continue;
+			if ((m_cbExpected = SystemDataLengths[b & 0xF]) == 0)
+				EmitShort(b);
+			else
+				m_runningStatus = b;
+			continue;
+		}
+
+		++i;
+		if (m_runningStatus == 0)
+			continue;
+
+		m_data[m_cbData++] = b;
+		if (m_cbData < m_cbExpected)
+			continue;
+
+		EmitShort(m_runningStatus, m_data[0], m_cbExpected > 1 ? m_data[1] : 0);
+		m_cbData = 0;
+		if (m_runningStatus >= 0xF0)
+			m_runningStatus = 0;
+	}
+
+	if (m_inSysex && !m_cbHead && i > start)
+		EmitSysex(&buffer[start], i - start);
+};
@@ -0,0 +1,36 @@
+#pragma once
+#include "Device.hpp"
+
+typedef void (*MidiParserHandler)(void* context, const Message& message);
+
+// Incremental framer for a raw MIDI byte stream, as read from a rawmidi port.
+// Short messages are handed on packed into a Message; SysEx is handed on as
+// spans of the buffer passed to Parse(), split wherever a read ended or a
+// realtime byte was interleaved. Only the first span of a SysEx starts with
+// F0h, and it always holds at least the SysexHeadSize bytes of the header (or
+// the whole message, if shorter) so receivers can check the function byte.
+class MidiParser
+{
+public:
+	// Enough for the bank and number in a Korg dump header, which is what
+	// replies are routed on.
+	static constexpr size_t SysexHeadSize { 9 };
+private:
+	MidiParserHandler m_handler;
+	void* m_context;
+	uint8_t m_runningStatus = 0;
+	uint8_t m_data[2];
+	uint8_t m_cbData = 0;
+	uint8_t m_cbExpected = 0;
+	bool m_inSysex = false;
+	uint8_t m_head[SysexHeadSize];
+	uint8_t m_cbHead = 0;
+
+	void EmitShort(uint8_t status, uint8_t byte1 = 0, uint8_t byte2 = 0);
+	void EmitSysex(uint8_t* buffer, size_t cbBuffer);
+	void FlushHead();
+public:
+	MidiParser(MidiParserHandler handler, void* context);
+	void Parse(uint8_t* buffer, size_t cbBuffer);
+	void Reset();
+};
@@ -1,17 +1,50 @@
 #pragma once
 #include "Device.hpp"
 
+struct OutputStatistics
+{
+	size_t QueueSize;                   // Bytes the writer thread can hold
+	size_t QueuedBytes;                 // Bytes waiting for the writer right now
+	size_t QueueHighWater;              // Most bytes ever waiting at once
+	uint64_t BytesWritten;              // Bytes the kernel has taken
+	uint64_t PartialWrites;             // Writes the kernel took only part of
+	uint64_t WriterStallMicroseconds;   // Writer waiting for room in the kernel buffer
+	uint64_t ProducerStallMicroseconds; // Senders waiting for room in the queue
+	uint64_t PacingDelayMicroseconds;   // Writer holding back to keep to the pacing
+};
+
+// Limits on how fast data goes out, for devices that can't take SysEx as fast
+// as USB delivers it. Zero means no limit.
+struct OutputPacing
+{
+	uint32_t BytesPerSecond = 0;
+	// Quiet time after the end of each SysEx before the next one starts.
+	uint32_t MessageGapMicroseconds = 0;
+};
+
 class OutputDevice : public Device
 {
 private:
 	struct ImplType;
 	ImplType* m_impl;
 	OutputDevice(ImplType* impl);
+#ifndef _WIN32
+	bool OpenRawMidi();
+	bool OpenSequencer();
+	bool OpenLoopback();
+	void CloseHandles();
+	ssize_t Write(const uint8_t* span, size_t cbSpan);
+	void WriteLoop();
+	void Enqueue(const void* buffer, size_t cbBuffer);
+#endif
 public:
 	static bool EnumerateNext(DeviceEnumerator*);
 	static void StopEnumeration(DeviceEnumerator*);
 	static bool GetName(const DeviceEnumerator*, char* out, size_t cchOut);
 	static OutputDevice* GetByName(const char* name);
+	// As GetByName, trying the address the device had last time before looking
+	// for it, which saves enumerating devices if it's still there.
+	static OutputDevice* GetByName(const char* name, const char* lastAddress);
 	static OutputDevice* GetByID(int id);
 	static bool GetName(int id, char* out);
 	static size_t Count();
@@ -21,7 +54,12 @@ public:
 	const char* Name() const override;
 
 	void LongMessage(const void* Buffer, size_t cbBuffer);
+	// Sends head and body back to back as one message.
+	void LongMessage(const void* head, size_t cbHead, const void* body, size_t cbBody);
 	void SendMessage(Message* message);
+	bool GetStatistics(OutputStatistics* out) const;
+	void SetPacing(const OutputPacing& pacing);
+	OutputPacing GetPacing() const;
 protected:
 	virtual void callback(MIDIMessage msg, uintptr_t dw1, uintptr_t dw2) override;
 };
@@ -1,16 +1,80 @@
 #include "OutputDevice.hpp"
+#include "Loopback.hpp"
 #include <alsa/asoundlib.h>
 #include <linux/soundcard.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 #include "Device.unix.inc"
 
+// Bytes queued between senders and the writer thread. Senders block once it's
+// full, so a bank upload is held back here rather than dropped by the kernel.
+static constexpr size_t WriteQueueSize    { 64 * 1024 };
+static constexpr size_t KernelBufferSize  { 16 * 1024 };
+// How long Close waits for the device to take what's still queued.
+static constexpr int    DrainTimeout      { 1000 };
+// The pacer lets this many seconds' worth of bytes out in one go, so paced
+// writes aren't all tiny.
+static constexpr double PacingBurst       { 0.01 };
+static constexpr double MinimumBurst      { 16 };
+// Sequencer backend: the largest SysEx event sent, as the kernel's own MIDI
+// ports split SysEx.
+static constexpr size_t SequencerSysexChunk { 256 };
+
 struct OutputDevice::ImplType
 {
 	char Name[32];
-	snd_rawmidi_t* Handle;
+	DeviceBackend Backend = DeviceBackend::RawMidi;
+	// What the device was asked for by, looked up again on each Open in case
+	// it has been unplugged and come back as another card.
+	std::string Key;
+	snd_rawmidi_t* Handle = nullptr;
+	// Sequencer backend: a port of our own connected to Dest. Queued bytes are
+	// encoded into events, one of which may be waiting for room in the kernel.
+	snd_seq_t* Seq = nullptr;
+	snd_seq_addr_t Dest;
+	int Port = -1;
+	snd_midi_event_t* Encoder = nullptr;
+	snd_seq_event_t Pending;
+	bool HasPending = false;
+	// Loopback backend: written to Fd, which belongs to Link.
+	Loopback* Link = nullptr;
+	int Fd = -1;
+	int WakeFd = -1;
+	std::thread Writer;
+	// Held for a whole message, so messages from different threads never interleave.
+	std::mutex SendLock;
+	// Guards everything below.
+	std::mutex Lock;
+	std::condition_variable DataReady;
+	std::condition_variable SpaceReady;
+	bool Stopping = false;
+	size_t Head = 0;
+	size_t Queued = 0;
+	size_t HighWater = 0;
+	uint64_t BytesWritten = 0;
+	uint64_t PartialWrites = 0;
+	uint64_t WriterStall = 0;
+	uint64_t ProducerStall = 0;
+	uint64_t PacingDelay = 0;
+	// Token bucket: Tokens bytes may go out now, refilled at Pacing.BytesPerSecond.
+	OutputPacing Pacing;
+	double Tokens = 0;
+	std::chrono::steady_clock::time_point Refilled;
+	std::chrono::steady_clock::time_point NextMessage;
+	uint8_t Queue[WriteQueueSize];
+};
+
+static uint64_t MicrosecondsSince(std::chrono::steady_clock::time_point start)
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
 };
 
 //struct OutputDevice::ImplType
@@ -32,46 +96,58 @@ OutputDevice::OutputDevice(ImplType* impl)
 
 OutputDevice* OutputDevice::GetByName(const char* name)
 {
-	// cardname:devicenum:subdevicenum
-	int status;
-	int card = -1;
-	char* cardname;
-	int device;
-	int subdevice = 0;
-	char nameIn[32];
-	char nameOut[32];
-	const char* p;
-
-	p = name + strlen(name);
-	do { --p; } while (p >= name && *p != ':');
-	subdevice = atoi(p + 1);
-	do { --p; } while (p >= name && *p != ':');
-	device = atoi(p + 1);
-	if (p > (name + 31)) p = name + 31;
-	strncpy(nameIn, name, p - name);
-	nameIn[p - name] = 0;
-
-	if ((status = snd_card_next(&card)) < 0)
-		return nullptr;
+	return GetByName(name, nullptr);
+};
 
-	if (card >= 0)
+OutputDevice* OutputDevice::GetByName(const char* name, const char* lastAddress)
+{
+	if (Device::Backend() == DeviceBackend::Sequencer)
 	{
-		while (card >= 0)
+		snd_seq_addr_t address;
+		if (!FindSequencerPort(name, false, &address))
 		{
-			if ((status = snd_card_get_name(card, &cardname)) < 0)
-				break;
-			if (strcmp(cardname, nameIn) == 0)
-				goto GotCard;
-			++card;
+			fprintf(stderr, "Couldn't find ALSA sequencer port '%s'\n", name);
+			return nullptr;
 		}
+		ImplType* impl = new ImplType;
+		impl->Backend = DeviceBackend::Sequencer;
+		impl->Dest = address;
+		snprintf(impl->Name, sizeof(impl->Name), "seq:%d:%d", address.client, address.port);
+		return new OutputDevice(impl);
+	}
+	if (Device::Backend() == DeviceBackend::Loopback)
+	{
+		Loopback* link = Loopback::Get(name);
+		if (link == nullptr)
+			return nullptr;
+		ImplType* impl = new ImplType;
+		impl->Backend = DeviceBackend::Loopback;
+		impl->Link = link;
+		snprintf(impl->Name, sizeof(impl->Name), "%s", link->Name());
+		return new OutputDevice(impl);
 	}
-	fprintf(stderr, "Couldn't find ALSA MIDI Device '%s'\n", name);
-	return nullptr;
 
-GotCard:
-	ImplType* impl = new ImplType;
-	snprintf(impl->Name, 32, "hw:%d,%d,%d", card, device, subdevice);
-	impl->Handle = nullptr;
+	ImplType* impl;
+	if (lastAddress && *lastAddress)
+	{
+		// Only looked for if Open finds something else there.
+		impl = new ImplType;
+		impl->Key = name;
+		snprintf(impl->Name, sizeof(impl->Name), "%s", lastAddress);
+		return new OutputDevice(impl);
+	}
+
+	// A subdevice name, or cardname:devicenum:subdevicenum
+	DeviceEntry entry;
+	if (!Devices().Find(false, name, &entry))
+	{
+		fprintf(stderr, "Couldn't find ALSA MIDI device '%s'\n", name);
+		return nullptr;
+	}
+
+	impl = new ImplType;
+	impl->Key = name;
+	snprintf(impl->Name, sizeof(impl->Name), "%s", entry.Address.c_str());
 	return new OutputDevice(impl);
 };
 
@@ -82,111 +158,478 @@ OutputDevice::~OutputDevice()
 }
 
 bool OutputDevice::Close()
+{
+	if (m_impl->Writer.joinable())
+	{
+		// The writer finishes what's queued, giving up if the device stops taking it.
+		{
+			std::lock_guard<std::mutex> lock(m_impl->Lock);
+			m_impl->Stopping = true;
+		}
+		m_impl->DataReady.notify_all();
+		m_impl->SpaceReady.notify_all();
+		uint64_t one = 1;
+		if (write(m_impl->WakeFd, &one, sizeof(one)) < 0)
+			fprintf(stderr, "Failed to stop writer for ALSA MIDI device '%s'\n", m_impl->Name);
+		m_impl->Writer.join();
+	}
+	if (m_impl->WakeFd >= 0)
+		close(m_impl->WakeFd);
+	m_impl->WakeFd = -1;
+
+	CloseHandles();
+	Device::Close();
+	printf("Closed ALSA output %s\n", Name());
+	return true;
+};
+
+void OutputDevice::CloseHandles()
 {
 	if (m_impl->Handle)
 		snd_rawmidi_close(m_impl->Handle);
 	m_impl->Handle = 0;
-	printf("Closed ALSA output %s\n", Name());
-	return true;
+	m_impl->Fd = -1;
+	if (m_impl->Seq)
+		snd_seq_close(m_impl->Seq);
+	m_impl->Seq = nullptr;
+	m_impl->Port = -1;
+	if (m_impl->Encoder)
+		snd_midi_event_free(m_impl->Encoder);
+	m_impl->Encoder = nullptr;
+	m_impl->HasPending = false;
 };
 
+// out has room for 32 characters, as with WinMM's device names.
 bool OutputDevice::GetName(int id, char* out)
 {
-	throw "not implemented";
+	if (id < 0)
+		return false;
+
+	if (Device::Backend() == DeviceBackend::Sequencer)
+	{
+		snd_seq_addr_t address;
+		return GetSequencerPortAt((size_t)id, false, &address, out, 32);
+	}
+	if (Device::Backend() == DeviceBackend::Loopback)
+		return GetLoopbackName((size_t)id, out, 32);
+
+	DeviceEntry entry;
+	if (!Devices().At(false, (size_t)id, &entry))
+		return false;
+	snprintf(out, 32, "%s", entry.Name.c_str());
+	return true;
 };
 
 void OutputDevice::StopEnumeration(DeviceEnumerator* i)
 {
 	if (i->ctl)
-		snd_ctl_close((snd_ctl_t*)i->ctl);
+		snd_seq_close((snd_seq_t*)i->ctl);
 	i->ctl = nullptr;
 };
 
 bool OutputDevice::GetName(const DeviceEnumerator* i, char* out, size_t cchOut)
 {
-	if (i->ctl == nullptr)
-		return false;
+	if (Device::Backend() == DeviceBackend::Sequencer)
+		return i->ctl && GetSequencerPortName((snd_seq_t*)i->ctl, i->card, i->device, out, cchOut);
+	if (Device::Backend() == DeviceBackend::Loopback)
+		return i->index != 0 && GetLoopbackName(i->index - 1, out, cchOut);
 
-	snd_rawmidi_info_t* info;
-	snd_rawmidi_info_alloca(&info);
-	snd_rawmidi_info_set_device(info, i->device);
-	snd_rawmidi_info_set_stream(info, SND_RAWMIDI_STREAM_OUTPUT);
-	snd_rawmidi_info_set_subdevice(info, i->subdevice);
-	auto name = snd_rawmidi_info_get_subdevice_name(info);
-	strncpy(out, name, cchOut);
+	DeviceEntry entry;
+	if (i->index == 0 || !Devices().At(false, i->index - 1, &entry))
+		return false;
+	strncpy(out, entry.Name.c_str(), cchOut);
 	return true;
 };
 
 bool OutputDevice::EnumerateNext(DeviceEnumerator* i)
 {
-	if (i->ctl == nullptr)
+	if (Device::Backend() == DeviceBackend::Sequencer)
 	{
-		i->card = -1;
-		goto NextCard;
+		if (i->ctl == nullptr)
+		{
+			if ((i->ctl = OpenSequencerClient(SND_SEQ_OPEN_OUTPUT)) == nullptr)
+				return false;
+			i->card = -1;
+			i->device = -1;
+		}
+		return NextSequencerPort((snd_seq_t*)i->ctl, &i->card, &i->device, false);
+	}
+	if (Device::Backend() == DeviceBackend::Loopback)
+	{
+		if (Loopback::At(i->index) == nullptr)
+			return false;
+		++i->index;
+		return true;
 	}
 
-	++i->subdevice;
-
-CheckSubdevice:
-	if (i->subdevice >= i->nSubdevices)
-		goto NextDevice;
-
-	return true;
-
-NextCard:
-	char name[32];
-	if (i->ctl)
-		snd_ctl_close((snd_ctl_t*)i->ctl);
-	if (snd_card_next(&i->card) <= 0 || i->card < 0)
+	DeviceEntry entry;
+	if (!Devices().At(false, i->index, &entry))
 		return false;
-	snprintf(name, 32, "hw:%d", i->card);
-	if (snd_ctl_open((snd_ctl_t**)&i->ctl, name, 0) < 0)
-		goto NextCard;
-
-	i->subdevice = 0;
-	i->nSubdevices = 0;
-	i->device = -1;
-	goto NextDevice;
-
-NextDevice:
-	i->subdevice = 0;
-	if (snd_ctl_rawmidi_next_device((snd_ctl_t*)i->ctl, &i->device) < 0 || i->device < 0)
-		goto NextCard;
-	snd_rawmidi_info_t* info;
-	snd_rawmidi_info_alloca(&info);
-	snd_rawmidi_info_set_device(info, i->device);
-	snd_rawmidi_info_set_stream(info, SND_RAWMIDI_STREAM_OUTPUT);
-	if (snd_ctl_rawmidi_info((snd_ctl_t*)i->ctl, info) < 0)
-		goto NextDevice;
-	i->nSubdevices = snd_rawmidi_info_get_subdevices_count(info);
-	goto CheckSubdevice;
+	i->card = entry.Card;
+	i->device = entry.Device;
+	i->subdevice = entry.Subdevice;
+	++i->index;
+	return true;
 };
 
 OutputDevice* OutputDevice::GetByID(int id)
 {
-	throw "not implemented";
+	if (id < 0)
+		return nullptr;
+
+	if (Device::Backend() == DeviceBackend::Sequencer)
+	{
+		snd_seq_addr_t address;
+		char name[64];
+		if (!GetSequencerPortAt((size_t)id, false, &address, name, sizeof(name)))
+			return nullptr;
+		snprintf(name, sizeof(name), "%d:%d", address.client, address.port);
+		return GetByName(name);
+	}
+	if (Device::Backend() == DeviceBackend::Loopback)
+	{
+		Loopback* link = Loopback::At((size_t)id);
+		return link ? GetByName(link->Name()) : nullptr;
+	}
+
+	// IDs are positions in the registry, which is in card, device and
+	// subdevice order, so a setup that hasn't changed numbers the same way
+	// every time.
+	DeviceEntry entry;
+	if (!Devices().At(false, (size_t)id, &entry))
+		return nullptr;
+	return GetByName(entry.Name.c_str(), entry.Address.c_str());
 };
 
-size_t OutputDevice::Count() { return GetTotalDeviceCount(false); };
+size_t OutputDevice::Count()
+{
+	if (Device::Backend() == DeviceBackend::Sequencer)
+		return GetSequencerPortCount(false);
+	if (Device::Backend() == DeviceBackend::Loopback)
+		return Loopback::Count();
+	return Devices().Count(false);
+};
 
 bool OutputDevice::Open()
 {
 	if (m_isOpen)
 		return true;
 
-	snd_rawmidi_t* handle;
-	if (snd_rawmidi_open(NULL, &handle, m_impl->Name, SND_RAWMIDI_NONBLOCK) < 0)
+	bool opened;
+	switch (m_impl->Backend)
 	{
-		fprintf(stderr, "Failed to open ALSA MIDI device '%s'\n", m_impl->Name);
+	case DeviceBackend::Sequencer: opened = OpenSequencer(); break;
+	case DeviceBackend::Loopback:  opened = OpenLoopback(); break;
+	default:                       opened = OpenRawMidi(); break;
+	}
+	if (!opened)
+		return false;
+
+	if ((m_impl->WakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+	{
+		fprintf(stderr, "Failed to create writer wakeup for ALSA MIDI device '%s'\n", m_impl->Name);
+		CloseHandles();
 		return false;
 	}
 
 	printf("ALSA MIDI Device '%s' opened\n", m_impl->Name);
-	m_impl->Handle = handle;
+	m_impl->Stopping = false;
+	m_impl->Head = 0;
+	m_impl->Queued = 0;
 	Device::Open();
+	m_impl->Writer = std::thread(&OutputDevice::WriteLoop, this);
 	return true;
 };
 
+bool OutputDevice::OpenRawMidi()
+{
+	// Where the device was last time is tried first, as if it's still there
+	// that saves walking every card.
+	snd_rawmidi_t* handle = nullptr;
+	if (snd_rawmidi_open(NULL, &handle, m_impl->Name, SND_RAWMIDI_NONBLOCK) >= 0 && !RawMidiIsNamed(handle, m_impl->Key.c_str()))
+	{
+		snd_rawmidi_close(handle);
+		handle = nullptr;
+	}
+
+	DeviceEntry entry;
+	if (handle == nullptr && Devices().Find(false, m_impl->Key.c_str(), &entry))
+		snprintf(m_impl->Name, sizeof(m_impl->Name), "%s", entry.Address.c_str());
+	if (handle == nullptr && snd_rawmidi_open(NULL, &handle, m_impl->Name, SND_RAWMIDI_NONBLOCK) < 0)
+	{
+		fprintf(stderr, "Failed to open ALSA MIDI device '%s'\n", m_impl->Name);
+		return false;
+	}
+
+	snd_rawmidi_params_t* params;
+	snd_rawmidi_params_alloca(&params);
+	if (snd_rawmidi_params_current(handle, params) < 0
+		|| snd_rawmidi_params_set_buffer_size(handle, params, KernelBufferSize) < 0
+		|| snd_rawmidi_params(handle, params) < 0)
+		fprintf(stderr, "Couldn't enlarge send buffer for ALSA MIDI device '%s'\n", m_impl->Name);
+
+	m_impl->Handle = handle;
+	return true;
+};
+
+// Connects a port of our own to the destination, which other applications
+// can keep sending to as well.
+bool OutputDevice::OpenSequencer()
+{
+	if ((m_impl->Seq = OpenSequencerClient(SND_SEQ_OPEN_OUTPUT)) == nullptr)
+		return false;
+
+	m_impl->Port = snd_seq_create_simple_port(m_impl->Seq, "M3 Helper output",
+		SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_NO_EXPORT,
+		SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+	if (m_impl->Port < 0
+		|| snd_seq_connect_to(m_impl->Seq, m_impl->Port, m_impl->Dest.client, m_impl->Dest.port) < 0
+		|| snd_midi_event_new(SequencerSysexChunk, &m_impl->Encoder) < 0)
+	{
+		fprintf(stderr, "Failed to connect to ALSA sequencer port '%s'\n", m_impl->Name);
+		CloseHandles();
+		return false;
+	}
+	m_impl->HasPending = false;
+	return true;
+};
+
+bool OutputDevice::OpenLoopback()
+{
+	m_impl->Fd = m_impl->Link->OutputFd();
+	return true;
+};
+
+// Hands bytes to the kernel, returning how many it took or -EAGAIN if it has
+// no room for any.
+ssize_t OutputDevice::Write(const uint8_t* span, size_t cbSpan)
+{
+	if (m_impl->Backend == DeviceBackend::Loopback)
+	{
+		ssize_t cbWritten = write(m_impl->Fd, span, cbSpan);
+		return cbWritten < 0 ? -errno : cbWritten;
+	}
+	if (m_impl->Backend != DeviceBackend::Sequencer)
+		return snd_rawmidi_write(m_impl->Handle, span, cbSpan);
+
+	// An event encoded last time but refused goes before anything new, and
+	// the bytes it was made from have already been counted as written.
+	int result;
+	if (m_impl->HasPending)
+	{
+		if ((result = snd_seq_event_output_direct(m_impl->Seq, &m_impl->Pending)) < 0)
+			return result;
+		m_impl->HasPending = false;
+	}
+
+	size_t cbEncoded = 0;
+	while (cbEncoded < cbSpan)
+	{
+		snd_seq_event_t ev;
+		long used = snd_midi_event_encode(m_impl->Encoder, span + cbEncoded, (long)(cbSpan - cbEncoded), &ev);
+		if (used <= 0)
+			return cbEncoded ? (ssize_t)cbEncoded : (used < 0 ? used : -EINVAL);
+		cbEncoded += (size_t)used;
+		if (ev.type == SND_SEQ_EVENT_NONE)
+			continue;
+
+		snd_seq_ev_set_source(&ev, m_impl->Port);
+		snd_seq_ev_set_subs(&ev);
+		snd_seq_ev_set_direct(&ev);
+		if ((result = snd_seq_event_output_direct(m_impl->Seq, &ev)) == -EAGAIN)
+		{
+			m_impl->Pending = ev;
+			m_impl->HasPending = true;
+			break;
+		}
+		if (result < 0)
+			return result;
+	}
+	return (ssize_t)cbEncoded;
+};
+
+void OutputDevice::WriteLoop()
+{
+	bool sequencer = m_impl->Backend == DeviceBackend::Sequencer;
+	bool pipe = m_impl->Backend == DeviceBackend::Loopback;
+	int nDescriptors = pipe ? 1 : sequencer ? snd_seq_poll_descriptors_count(m_impl->Seq, POLLOUT) : snd_rawmidi_poll_descriptors_count(m_impl->Handle);
+	struct pollfd* fds = (struct pollfd*)alloca(sizeof(struct pollfd) * (nDescriptors + 1));
+	fds[0].fd = m_impl->WakeFd;
+	fds[0].events = POLLIN;
+	fds[0].revents = 0;
+	if (pipe)
+	{
+		fds[1].fd = m_impl->Fd;
+		fds[1].events = POLLOUT;
+		fds[1].revents = 0;
+	}
+	else
+		nDescriptors = sequencer
+			? snd_seq_poll_descriptors(m_impl->Seq, &fds[1], nDescriptors, POLLOUT)
+			: snd_rawmidi_poll_descriptors(m_impl->Handle, &fds[1], nDescriptors);
+
+	std::unique_lock<std::mutex> lock(m_impl->Lock);
+	for (;;)
+	{
+		// An event the sequencer refused is still owed to the device even once
+		// the bytes it came from have left the queue.
+		m_impl->DataReady.wait(lock, [this] { return m_impl->Queued != 0 || m_impl->HasPending || m_impl->Stopping; });
+		if (m_impl->Queued == 0 && !m_impl->HasPending)
+			return;
+
+		// Senders only ever append past Head + Queued, so the span can be
+		// written without the lock.
+		bool stopping = m_impl->Stopping;
+		const uint8_t* span = &m_impl->Queue[m_impl->Head];
+		size_t cbSpan = WriteQueueSize - m_impl->Head;
+		if (cbSpan > m_impl->Queued)
+			cbSpan = m_impl->Queued;
+
+		// Pacing is dropped when closing, so draining doesn't take any longer.
+		if (!stopping)
+		{
+			auto now = std::chrono::steady_clock::now();
+			auto until = now;
+			if (now < m_impl->NextMessage)
+				until = m_impl->NextMessage;
+			else if (m_impl->Pacing.BytesPerSecond)
+			{
+				double rate = m_impl->Pacing.BytesPerSecond;
+				double burst = rate * PacingBurst > MinimumBurst ? rate * PacingBurst : MinimumBurst;
+				m_impl->Tokens += rate * std::chrono::duration<double>(now - m_impl->Refilled).count();
+				if (m_impl->Tokens > burst)
+					m_impl->Tokens = burst;
+				m_impl->Refilled = now;
+				if (m_impl->Tokens < 1)
+					until = now + std::chrono::microseconds((int64_t)((1 - m_impl->Tokens) * 1000000 / rate) + 1);
+				else if (cbSpan > (size_t)m_impl->Tokens)
+					cbSpan = (size_t)m_impl->Tokens;
+			}
+			if (until > now)
+			{
+				m_impl->DataReady.wait_until(lock, until, [this] { return m_impl->Stopping; });
+				m_impl->PacingDelay += MicrosecondsSince(now);
+				continue;
+			}
+			if (m_impl->Pacing.MessageGapMicroseconds)
+			{
+				// Stop at the end of the SysEx, so the gap can follow it.
+				const uint8_t* end = (const uint8_t*)memchr(span, 0xF7, cbSpan);
+				if (end)
+					cbSpan = (size_t)(end - span) + 1;
+			}
+		}
+		lock.unlock();
+
+		ssize_t cbWritten = Write(span, cbSpan);
+		if (cbWritten == -EAGAIN || (cbWritten == 0 && cbSpan != 0))
+		{
+			// The kernel buffer is full: wait until the device has taken some.
+			auto start = std::chrono::steady_clock::now();
+			int result = poll(fds, nDescriptors + 1, stopping ? DrainTimeout : -1);
+			uint64_t count;
+			if (fds[0].revents && read(m_impl->WakeFd, &count, sizeof(count)) < 0)
+				fprintf(stderr, "Failed to clear writer wakeup for ALSA MIDI device '%s'\n", m_impl->Name);
+			lock.lock();
+			m_impl->WriterStall += MicrosecondsSince(start);
+			if (result == 0 || (result < 0 && errno != EINTR))
+			{
+				fprintf(stderr, "ALSA MIDI device '%s' stopped taking data, dropping %zu bytes\n", m_impl->Name, m_impl->Queued);
+				m_impl->Queued = 0;
+				m_impl->HasPending = false;
+				m_impl->SpaceReady.notify_all();
+			}
+			continue;
+		}
+
+		lock.lock();
+		if (cbWritten < 0)
+		{
+			// Whatever is queued can't be sent in one piece any more.
+			fprintf(stderr, "Writing ALSA MIDI device '%s' failed, dropping %zu bytes: %s\n", m_impl->Name, m_impl->Queued, snd_strerror((int)cbWritten));
+			m_impl->Queued = 0;
+			m_impl->HasPending = false;
+		}
+		else
+		{
+			if ((size_t)cbWritten < cbSpan)
+				++m_impl->PartialWrites;
+			if (m_impl->Pacing.BytesPerSecond)
+				m_impl->Tokens -= (double)cbWritten;
+			if (m_impl->Pacing.MessageGapMicroseconds && cbWritten > 0 && span[cbWritten - 1] == 0xF7)
+				m_impl->NextMessage = std::chrono::steady_clock::now() + std::chrono::microseconds(m_impl->Pacing.MessageGapMicroseconds);
+			m_impl->Head = (m_impl->Head + (size_t)cbWritten) % WriteQueueSize;
+			m_impl->Queued -= (size_t)cbWritten;
+			m_impl->BytesWritten += (uint64_t)cbWritten;
+		}
+		m_impl->SpaceReady.notify_all();
+	}
+};
+
+// Copies into the queue, waiting for the writer to make room when it's full.
+// The caller holds SendLock.
+void OutputDevice::Enqueue(const void* buffer, size_t cbBuffer)
+{
+	const uint8_t* p = (const uint8_t*)buffer;
+	std::unique_lock<std::mutex> lock(m_impl->Lock);
+	while (cbBuffer > 0 && !m_impl->Stopping)
+	{
+		if (m_impl->Queued == WriteQueueSize)
+		{
+			auto start = std::chrono::steady_clock::now();
+			m_impl->SpaceReady.wait(lock, [this] { return m_impl->Queued < WriteQueueSize || m_impl->Stopping; });
+			m_impl->ProducerStall += MicrosecondsSince(start);
+			continue;
+		}
+
+		size_t tail = (m_impl->Head + m_impl->Queued) % WriteQueueSize;
+		size_t cbCopy = WriteQueueSize - tail;
+		if (cbCopy > WriteQueueSize - m_impl->Queued)
+			cbCopy = WriteQueueSize - m_impl->Queued;
+		if (cbCopy > cbBuffer)
+			cbCopy = cbBuffer;
+		memcpy(&m_impl->Queue[tail], p, cbCopy);
+		m_impl->Queued += cbCopy;
+		if (m_impl->Queued > m_impl->HighWater)
+			m_impl->HighWater = m_impl->Queued;
+		p += cbCopy;
+		cbBuffer -= cbCopy;
+		m_impl->DataReady.notify_one();
+	}
+};
+
+bool OutputDevice::GetStatistics(OutputStatistics* out) const
+{
+	std::lock_guard<std::mutex> lock(m_impl->Lock);
+	out->QueueSize                 = WriteQueueSize;
+	out->QueuedBytes               = m_impl->Queued;
+	out->QueueHighWater            = m_impl->HighWater;
+	out->BytesWritten              = m_impl->BytesWritten;
+	out->PartialWrites             = m_impl->PartialWrites;
+	out->WriterStallMicroseconds   = m_impl->WriterStall;
+	out->ProducerStallMicroseconds = m_impl->ProducerStall;
+	out->PacingDelayMicroseconds   = m_impl->PacingDelay;
+	return true;
+};
+
+void OutputDevice::SetPacing(const OutputPacing& pacing)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_impl->Lock);
+		m_impl->Pacing = pacing;
+		m_impl->Tokens = 0;
+		m_impl->Refilled = std::chrono::steady_clock::now();
+		m_impl->NextMessage = {};
+	}
+	m_impl->DataReady.notify_all();
+};
+
+OutputPacing OutputDevice::GetPacing() const
+{
+	std::lock_guard<std::mutex> lock(m_impl->Lock);
+	return m_impl->Pacing;
+};
+
 static constexpr int PAD(int x) { return ((x+3)/4)*4; };
 
 void OutputDevice::LongMessage(const void* Buffer, size_t cbBuffer)
@@ -194,7 +637,18 @@ void OutputDevice::LongMessage(const void* Buffer, size_t cbBuffer)
 	if(!m_isOpen)
 		return;
 
-	snd_rawmidi_write(m_impl->Handle, Buffer, cbBuffer);
+	std::lock_guard<std::mutex> lock(m_impl->SendLock);
+	Enqueue(Buffer, cbBuffer);
+};
+
+void OutputDevice::LongMessage(const void* head, size_t cbHead, const void* body, size_t cbBody)
+{
+	if(!m_isOpen)
+		return;
+
+	std::lock_guard<std::mutex> lock(m_impl->SendLock);
+	Enqueue(head, cbHead);
+	Enqueue(body, cbBody);
 };
 
 #undef SendMessage
@@ -211,7 +665,8 @@ void OutputDevice::SendMessage(Message* message)
 	else
 	{
 		int size = message->Type() == MessageType::System ? SystemMessageLengths[(int)message->SubType()] : MessageLengths[(int)message->Type() - 8];
-		snd_rawmidi_write(m_impl->Handle, message, size);
+		std::lock_guard<std::mutex> lock(m_impl->SendLock);
+		Enqueue(message, size);
 	}
 };
 
@@ -6,6 +6,9 @@ struct OutputDevice::ImplType
 	UINT Id;
 	MIDIINCAPS Capabilities;
 	HMIDIOUT Handle;
+	OutputPacing Pacing;
+	// Tick count before which the next message must not start.
+	ULONGLONG NextSend = 0;
 	void CALLBACK Callback(HMIDIOUT hDevice, UINT msg, DWORD_PTR dwInstance, DWORD_PTR dw1, DWORD_PTR dw2);
 };
 
@@ -48,6 +51,12 @@ OutputDevice* OutputDevice::GetByName(const char* name)
 	return nullptr;
 };
 
+OutputDevice* OutputDevice::GetByName(const char* name, [[maybe_unused]] const char* lastAddress)
+{
+	// Looking a device up by name is already cheap with WinMM.
+	return GetByName(name);
+};
+
 OutputDevice* OutputDevice::GetByID(int id)
 {
 	if ((UINT)id >= ::midiOutGetNumDevs())
@@ -116,6 +125,35 @@ bool OutputDevice::Close()
 
 static constexpr int PAD(int x) { return ((x+3)/4)*4; };
 
+void OutputDevice::LongMessage(const void* head, size_t cbHead, const void* body, size_t cbBody)
+{
+	// midiOutLongMsg wants the whole message in one buffer.
+	uint8_t* buffer = (uint8_t*)malloc(cbHead + cbBody);
+	if (buffer == nullptr)
+		throw std::bad_alloc();
+	memcpy(buffer, head, cbHead);
+	memcpy(buffer + cbHead, body, cbBody);
+	LongMessage(buffer, cbHead + cbBody);
+	free(buffer);
+};
+
+bool OutputDevice::GetStatistics([[maybe_unused]] OutputStatistics* out) const
+{
+	// WinMM queues and writes on its own; there's nothing to report.
+	return false;
+};
+
+void OutputDevice::SetPacing(const OutputPacing& pacing)
+{
+	m_impl->Pacing = pacing;
+	m_impl->NextSend = 0;
+};
+
+OutputPacing OutputDevice::GetPacing() const
+{
+	return m_impl->Pacing;
+};
+
 void OutputDevice::LongMessage(const void* Buffer, size_t cbBuffer)
 {
 	LPMIDIHDR header = (LPMIDIHDR)malloc(sizeof(MIDIHDR)+PAD(cbBuffer));
@@ -129,8 +167,17 @@ void OutputDevice::LongMessage(const void* Buffer, size_t cbBuffer)
 	
 	if(!m_isOpen)
 		Open();
+
+	// WinMM sends each message whole, so pacing can only space messages out:
+	// each one waits for the time the one before should have taken.
+	ULONGLONG now = GetTickCount64();
+	if (now < m_impl->NextSend)
+		Sleep((DWORD)(m_impl->NextSend - now));
 	Assert(::midiOutPrepareHeader(m_impl->Handle, header, sizeof(MIDIHDR)), "Preparing SysEx buffer");
 	Assert(::midiOutLongMsg(m_impl->Handle, header, sizeof(MIDIHDR)), "Sending SysEx data");
+	if (m_impl->Pacing.BytesPerSecond || m_impl->Pacing.MessageGapMicroseconds)
+		m_impl->NextSend = GetTickCount64() + m_impl->Pacing.MessageGapMicroseconds / 1000
+			+ (m_impl->Pacing.BytesPerSecond ? cbBuffer * 1000 / m_impl->Pacing.BytesPerSecond : 0);
 };
 
 #undef SendMessage
@@ -0,0 +1,155 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+
+// Bounded lock-free ring for exactly one producer thread and one consumer
+// thread. Slots are filled and drained in place: the producer reserves a slot,
+// writes into it and commits it; the consumer acquires however many slots are
+// ready, works on them directly and releases them as a batch.
+//
+// Each index lives on its own cache line, next to the other side's last-seen
+// copy of it, so the consumer doesn't touch the producer's line unless the ring
+// looks empty. The producer reads the head once per commit, to keep the
+// high-water mark true.
+template <typename T, size_t Capacity>
+class SpscRing
+{
+	static_assert(Capacity && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+	static constexpr size_t CacheLineSize { 64 };
+	static constexpr size_t Mask { Capacity - 1 };
+	// Set in the published tail once the producer is finished, so a consumer
+	// sleeping on the tail wakes up.
+	static constexpr size_t ClosedBit { ~(~(size_t)0 >> 1) };
+	// Set in the published head to give up waiting for space, so a producer
+	// sleeping on the head wakes up.
+	static constexpr size_t CancelledBit { ClosedBit };
+
+	// Producer side
+	alignas(CacheLineSize) std::atomic<size_t> m_tail { 0 };
+	size_t m_producerTail = 0;
+	size_t m_cachedHead = 0;
+	size_t m_stalls = 0;
+	size_t m_highWater = 0;
+	// Consumer side
+	alignas(CacheLineSize) std::atomic<size_t> m_head { 0 };
+	size_t m_consumerHead = 0;
+	size_t m_cachedTail = 0;
+	// Statistics, written only when they change
+	alignas(CacheLineSize) std::atomic<size_t> m_reportedStalls { 0 };
+	std::atomic<size_t> m_reportedHighWater { 0 };
+
+	alignas(CacheLineSize) T m_slots[Capacity];
+
+public:
+	// Producer: returns the next free slot, or nullptr (and counts a stall) if
+	// the consumer hasn't freed one yet.
+	T* Reserve()
+	{
+		if (m_producerTail - m_cachedHead == Capacity)
+		{
+			m_cachedHead = m_head.load(std::memory_order_acquire) & ~CancelledBit;
+			if (m_producerTail - m_cachedHead == Capacity)
+			{
+				m_reportedStalls.store(++m_stalls, std::memory_order_relaxed);
+				return nullptr;
+			}
+		}
+		return &m_slots[m_producerTail & Mask];
+	};
+
+	// Producer: publishes the slot returned by the last Reserve().
+	void Commit()
+	{
+		m_tail.store(++m_producerTail, std::memory_order_release);
+		m_tail.notify_one();
+		// The cached head can be far behind, which would make the ring look full.
+		m_cachedHead = m_head.load(std::memory_order_acquire) & ~CancelledBit;
+		if (m_producerTail - m_cachedHead > m_highWater)
+			m_reportedHighWater.store(m_highWater = m_producerTail - m_cachedHead, std::memory_order_relaxed);
+	};
+
+	// Producer: blocks until the consumer has released at least one slot.
+	// Returns false if CancelWait() was called, before or during the wait.
+	bool WaitForSpace()
+	{
+		for (;;)
+		{
+			size_t head = m_head.load(std::memory_order_acquire);
+			if (head & CancelledBit)
+				return false;
+			m_cachedHead = head;
+			if (m_producerTail - m_cachedHead != Capacity)
+				return true;
+			m_head.wait(head, std::memory_order_acquire);
+		}
+	};
+
+	// Any thread: makes WaitForSpace() return false from now on, for stopping a
+	// producer whose consumer may never free a slot.
+	void CancelWait()
+	{
+		m_head.fetch_or(CancelledBit, std::memory_order_release);
+		m_head.notify_all();
+	};
+
+	// Producer: no more commits are coming. Anything already committed can still
+	// be drained; after that WaitForData() returns false.
+	void Close()
+	{
+		m_tail.store(m_producerTail | ClosedBit, std::memory_order_release);
+		m_tail.notify_all();
+	};
+
+	// Consumer: the number of committed slots, available through operator[].
+	size_t Acquire()
+	{
+		if (m_cachedTail == m_consumerHead)
+			m_cachedTail = m_tail.load(std::memory_order_acquire) & ~ClosedBit;
+		return m_cachedTail - m_consumerHead;
+	};
+
+	T& operator[](size_t i)
+	{
+		return m_slots[(m_consumerHead + i) & Mask];
+	};
+
+	// Consumer: hands the first count acquired slots back to the producer.
+	// Added rather than stored, so a CancelWait() meanwhile isn't lost.
+	void Release(size_t count)
+	{
+		m_consumerHead += count;
+		m_head.fetch_add(count, std::memory_order_release);
+		m_head.notify_one();
+	};
+
+	// Consumer: blocks until something is committed. Returns false once the ring
+	// has been closed and fully drained.
+	bool WaitForData()
+	{
+		for (;;)
+		{
+			size_t tail = m_tail.load(std::memory_order_acquire);
+			if ((tail & ~ClosedBit) != m_consumerHead)
+				return true;
+			if (tail & ClosedBit)
+				return false;
+			m_tail.wait(tail, std::memory_order_acquire);
+		}
+	};
+
+	// Empties the ring for reuse. Only call with neither side running.
+	void Reset()
+	{
+		m_tail.store(0, std::memory_order_relaxed);
+		m_head.store(0, std::memory_order_relaxed);
+		m_producerTail = m_cachedHead = 0;
+		m_consumerHead = m_cachedTail = 0;
+	};
+
+	// Number of times the producer found the ring full and had to wait. Nothing
+	// is lost when it does; the data waits where it came from.
+	size_t Stalls() const { return m_reportedStalls.load(std::memory_order_relaxed); };
+	// Most slots ever in use at once.
+	size_t HighWater() const { return m_reportedHighWater.load(std::memory_order_relaxed); };
+	static constexpr size_t Size() { return Capacity; };
+};
@@ -1,4 +1,5 @@
 #include "SysexBuilder.hpp"
+#include "KorgCodec.hpp"
 
 SysexBuilder::SysexBuilder(uint8_t deviceId) : m_deviceId(deviceId) {};
 
@@ -31,6 +32,27 @@ size_t SysexBuilder::CombiParameterDumpRequest(uint8_t* buffer, uint8_t bank, ui
 	return size;
 };
 
+size_t SysexBuilder::CombiBankDumpRequest(uint8_t* buffer, uint8_t bank)
+{
+	size_t size = Header(buffer, 0x72, 2);
+	buffer[5] = 0x11;
+	buffer[6] = bank;
+	return size;
+};
+
+// Builds the same message the M3 sends in reply to CombiParameterDumpRequest,
+// from unpacked combi data.
+size_t SysexBuilder::CombiParameterDump(uint8_t* buffer, uint8_t bank, uint8_t num, const uint8_t* data, size_t cbData)
+{
+	size_t size = Header(buffer, 0x73, CombiDumpHeaderSize - 5 + KorgPackedSize(cbData));
+	buffer[5] = 1;
+	buffer[6] = bank;
+	buffer[7] = 0;
+	buffer[8] = num;
+	KorgPack(data, cbData, &buffer[CombiDumpHeaderSize]);
+	return size;
+};
+
 size_t SysexBuilder::StoreCombination(uint8_t* buffer, uint8_t bank, uint8_t num)
 {
 	size_t size = Header(buffer, 0x77, 4);
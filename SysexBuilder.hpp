@@ -6,6 +6,11 @@
 
 class SysexBuilder
 {
+public:
+	// Offset of the packed data in a single combi dump (function 73h, kind 01h)
+	// and in a whole bank dump (function 73h, kind 11h).
+	static constexpr size_t CombiDumpHeaderSize { 9 };
+	static constexpr size_t CombiBankDumpHeaderSize { 7 };
 private:
 	const uint8_t m_deviceId;
 
@@ -14,6 +19,8 @@ public:
 	SysexBuilder(uint8_t deviceId);
 	size_t ModeChange(uint8_t* buffer, uint8_t mode) const;
 	size_t CombiParameterDumpRequest(uint8_t* buffer, uint8_t bank, uint8_t num);
+	size_t CombiBankDumpRequest(uint8_t* buffer, uint8_t bank);
+	size_t CombiParameterDump(uint8_t* buffer, uint8_t bank, uint8_t num, const uint8_t* data, size_t cbData);
 	size_t StoreCombination(uint8_t* buffer, uint8_t bank, uint8_t num);
 	size_t StoreCombinationBank(uint8_t* buffer, uint8_t bank);
 
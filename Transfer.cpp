@@ -0,0 +1,822 @@
+#include "Transfer.hpp"
+#include "KorgCodec.hpp"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+TransactionKey RequestKey(const uint8_t* request, size_t cbRequest, uint8_t expectedFunction)
+{
+	TransactionKey key;
+	key.Function = expectedFunction;
+	// Dump requests name what they want dumped, and the dump says what it is.
+	if (expectedFunction == 0x73 && cbRequest >= 7 && request[4] == 0x72)
+	{
+		key.Bank = request[6];
+		if (request[5] == 0x11)
+			key.Slot = TransactionKey::WholeBank;
+		else if (cbRequest >= 9)
+			key.Slot = request[8];
+	}
+	return key;
+};
+
+TransactionKey ReplyKey(const uint8_t* reply, size_t cbReply, bool* isError)
+{
+	TransactionKey key;
+	*isError = false;
+	if (cbReply < 5)
+		return key;
+
+	key.Function = reply[4];
+	switch (key.Function)
+	{
+	case 0x73:
+		if (cbReply >= 7)
+		{
+			key.Bank = reply[6];
+			if (reply[5] == 0x11)
+				key.Slot = TransactionKey::WholeBank;
+			else if (cbReply >= 9)
+				key.Slot = reply[8];
+		}
+		break;
+	case 0x22: // Write error
+		key.Function = 0x21;
+		*isError = true;
+		break;
+	case 0x26: // Data load error
+		key.Function = 0x24;
+		*isError = true;
+		break;
+	}
+	return key;
+};
+
+// Feeds one piece of an incoming SysEx to a transaction. Returns true once the
+// transaction is over, whether it finished or failed. A reply with some other
+// key isn't for this transaction and is ignored.
+static bool Receive(ReceiveContext* context, const MIDIEventArgs& e)
+{
+	const Message& message = e.Message;
+	size_t cbBuffer = message.BufferSize;
+
+	if (context->Status == ReceiveStatus::Waiting)
+	{
+		// Only the first piece of a SysEx starts with F0h; anything else is the
+		// rest of a reply that was ignored.
+		if (message.BufferSize == 0 || message.Buffer[0] != 0xF0)
+			return false;
+		bool isError;
+		if (!(ReplyKey(message.Buffer, message.BufferSize, &isError) == context->Key))
+			return false;
+
+		context->Activity.fetch_add(1, std::memory_order_relaxed);
+		if (context->SampleRoundTrip)
+		{
+			// The driver's arrival time leaves out however long the reply
+			// waited to be dispatched.
+			auto received = e.Timestamp == std::chrono::steady_clock::time_point {} ? std::chrono::steady_clock::now() : e.Timestamp;
+			RoundTrips().Sample(std::chrono::duration<double, std::milli>(received - context->SentAt).count());
+		}
+
+		context->ReceivedFunction = message.Buffer[4];
+		if (isError)
+		{
+			context->Status = ReceiveStatus::Error;
+			return true;
+		}
+
+		if (context->BufferIn == nullptr)
+		{
+			context->Status = ReceiveStatus::Finished;
+			return true;
+		}
+
+		context->Status = ReceiveStatus::Receiving;
+	}
+	else
+		context->Activity.fetch_add(1, std::memory_order_relaxed);
+
+	if (cbBuffer > context->cbBufferIn - context->rxIndex)
+		cbBuffer = context->cbBufferIn - context->rxIndex;
+	memcpy(context->BufferIn + context->rxIndex, message.Buffer, cbBuffer);
+	context->rxIndex += cbBuffer;
+	if (message.BufferSize > 0 && message.Buffer[message.BufferSize - 1] == 0xF7)
+	{
+		context->Status = ReceiveStatus::Finished;
+		return true;
+	}
+	else if (context->rxIndex == context->cbBufferIn)
+	{
+		context->Status = ReceiveStatus::Overflow;
+		return true;
+	}
+	return false;
+};
+
+void OnReceived(void* context_, [[maybe_unused]] void* sender, MIDIEventArgs& e)
+{
+	if (e.Message.Status != 0xF0)
+		return;
+
+	ReceiveContext* context = (ReceiveContext*)context_;
+	bool done = Receive(context, e);
+	if (done)
+		context->InputDevice->RemoveCallback(OnReceived, context_);
+
+	if (context->Callback)
+		context->Callback(context);
+
+	if (done)
+		context->Event.Signal();
+};
+
+// The SysEx a reply to a request for expectedFunction can come as, including
+// the error reply standing in for it.
+static MessageFilter ReplyFilter(uint8_t expectedFunction)
+{
+	MessageFilter filter;
+	filter.AddKorgFunction(expectedFunction);
+	if (expectedFunction == 0x21)
+		filter.AddKorgFunction(0x22);
+	else if (expectedFunction == 0x24)
+		filter.AddKorgFunction(0x26);
+	return filter;
+};
+
+void SendAndReceive(ReceiveContext* context)
+{
+	context->Status = ReceiveStatus::Waiting;
+	context->Key = RequestKey(context->BufferOut, context->cbBufferOut, context->expectedFunctionin);
+	context->SampleRoundTrip = ++context->Attempt == 1;
+	context->SentAt = std::chrono::steady_clock::now();
+	context->InputDevice->AddCallback(OnReceived, context, ReplyFilter(context->expectedFunctionin));
+	if (context->cbBufferOutHead)
+		context->OutputDevice->LongMessage(context->BufferOutHead, context->cbBufferOutHead, context->BufferOut, context->cbBufferOut);
+	else
+		context->OutputDevice->LongMessage(context->BufferOut, context->cbBufferOut);
+};
+
+TransactionTable::TransactionTable(class InputDevice* input, class OutputDevice* output)
+	: m_input(input)
+	, m_output(output)
+{
+	m_input->AddCallback(OnReceived, this, MessageFilter().AddKorgSysex());
+};
+
+TransactionTable::~TransactionTable()
+{
+	m_input->RemoveCallback(OnReceived, this);
+};
+
+void TransactionTable::Send(ReceiveContext* context)
+{
+	context->Status = ReceiveStatus::Waiting;
+	context->Key = RequestKey(context->BufferOut, context->cbBufferOut, context->expectedFunctionin);
+	context->SentAt = std::chrono::steady_clock::now();
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		context->SampleRoundTrip = ++context->Attempt == 1 && m_outstanding == 0;
+		m_pending[context->Key.Value()].push_back(context);
+		++m_outstanding;
+	}
+	if (context->cbBufferOutHead)
+		m_output->LongMessage(context->BufferOutHead, context->cbBufferOutHead, context->BufferOut, context->cbBufferOut);
+	else
+		m_output->LongMessage(context->BufferOut, context->cbBufferOut);
+};
+
+bool TransactionTable::Cancel(ReceiveContext* context)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	auto pending = m_pending.find(context->Key.Value());
+	if (pending == m_pending.end())
+		return false;
+	for (auto it = pending->second.begin(); it != pending->second.end(); ++it)
+	{
+		if (*it == context)
+		{
+			pending->second.erase(it);
+			--m_outstanding;
+			if (m_current == context)
+				m_current = nullptr;
+			context->Status = ReceiveStatus::Timeout;
+			return true;
+		}
+	}
+	return false;
+};
+
+size_t TransactionTable::Outstanding()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_outstanding;
+};
+
+size_t TransactionTable::Strays()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_strays;
+};
+
+void TransactionTable::OnReceived(void* context_, [[maybe_unused]] void* sender, MIDIEventArgs& e)
+{
+	if (e.Message.Status != 0xF0 || e.Message.BufferSize == 0)
+		return;
+
+	TransactionTable* table = (TransactionTable*)context_;
+	ReceiveContext* context;
+	bool done;
+	{
+		// Held across Receive so Cancel can't take the context away half way.
+		std::lock_guard<std::mutex> lock(table->m_lock);
+		if (e.Message.Buffer[0] == 0xF0)
+		{
+			bool isError;
+			auto pending = table->m_pending.find(ReplyKey(e.Message.Buffer, e.Message.BufferSize, &isError).Value());
+			table->m_current = pending != table->m_pending.end() && !pending->second.empty() ? pending->second.front() : nullptr;
+			if (table->m_current == nullptr)
+				++table->m_strays;
+		}
+		context = table->m_current;
+		if (context == nullptr)
+			return;
+
+		done = Receive(context, e);
+		if (done)
+		{
+			table->m_pending[context->Key.Value()].pop_front();
+			--table->m_outstanding;
+			table->m_current = nullptr;
+		}
+	}
+
+	if (context->Callback)
+		context->Callback(context);
+
+	if (done)
+	{
+		if (context->Completed)
+			context->Completed(context);
+		else
+			context->Event.Signal();
+	}
+};
+
+bool CombiBank::Fetch(TransactionTable& transactions, SysexBuilder& sysex, uint8_t bank, ProgressCallback callback)
+{
+	uint8_t request[16];
+	PooledBuffer dump(BankBuffers());
+	ReceiveContext context;
+	context.Initialise(nullptr, nullptr, callback);
+	context.FillSimple(request, sysex.CombiBankDumpRequest(request, bank), 0x73);
+	context.BufferIn = dump;
+	context.cbBufferIn = dump.Size();
+	transactions.Send(&context);
+	// No retry here: callers fall back to fetching combis one by one.
+	if (AwaitReply(&context, ReplyTimeout(&context, 1)) == ReceiveStatus::Timeout && !transactions.Cancel(&context))
+		context.Event.Wait();
+
+	m_cbCombi = 0;
+	if (context.Status != ReceiveStatus::Finished || context.rxIndex < SysexBuilder::CombiBankDumpHeaderSize + 1
+		|| dump[5] != 0x11 || dump[6] != bank)
+		return false;
+
+	size_t cbPacked = context.rxIndex - SysexBuilder::CombiBankDumpHeaderSize - 1;
+	m_data.resize(KorgUnpackedSize(cbPacked));
+	m_data.resize(KorgUnpack(&dump[SysexBuilder::CombiBankDumpHeaderSize], cbPacked, m_data.data()));
+	if (m_data.empty() || m_data.size() % CombisPerBank)
+		return false;
+
+	m_bank = bank;
+	m_cbCombi = m_data.size() / CombisPerBank;
+	return true;
+};
+
+size_t CombiBank::Slice(SysexBuilder& sysex, uint8_t num, uint8_t* buffer, size_t cbBuffer) const
+{
+	if (num >= CombisPerBank || SysexBuilder::CombiDumpHeaderSize + KorgPackedSize(m_cbCombi) + 1 > cbBuffer)
+		return 0;
+	return sysex.CombiParameterDump(buffer, m_bank, num, &m_data[num * m_cbCombi], m_cbCombi);
+};
+
+void RoundTripEstimator::Sample(double milliseconds)
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	if (m_samples++ == 0)
+	{
+		m_smoothed = milliseconds;
+		m_variation = milliseconds / 2;
+		return;
+	}
+	double error = milliseconds - m_smoothed;
+	m_variation += ((error < 0 ? -error : error) - m_variation) / 4;
+	m_smoothed += error / 8;
+};
+
+uint32_t RoundTripEstimator::Timeout()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	if (m_samples == 0)
+		return InitialTimeout;
+	double timeout = m_smoothed + 4 * m_variation;
+	if (timeout < MinimumTimeout)
+		return MinimumTimeout;
+	if (timeout > MaximumTimeout)
+		return MaximumTimeout;
+	return (uint32_t)timeout;
+};
+
+double RoundTripEstimator::Smoothed()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_smoothed;
+};
+
+double RoundTripEstimator::Variation()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_variation;
+};
+
+size_t RoundTripEstimator::Samples()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_samples;
+};
+
+bool RoundTripEstimator::Load(const char* path)
+{
+	FILE* file = fopen(path, "r");
+	if (file == nullptr)
+		return false;
+
+	double smoothed, variation;
+	size_t samples;
+	bool ok = fscanf(file, "%lf %lf %zu", &smoothed, &variation, &samples) == 3
+		&& smoothed >= 0 && smoothed <= MaximumTimeout && variation >= 0 && variation <= MaximumTimeout;
+	fclose(file);
+	if (!ok)
+		return false;
+
+	std::lock_guard<std::mutex> lock(m_lock);
+	m_smoothed = smoothed;
+	m_variation = variation;
+	m_samples = samples;
+	return true;
+};
+
+bool RoundTripEstimator::Save(const char* path)
+{
+	double smoothed, variation;
+	size_t samples;
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (m_samples == 0)
+			return false;
+		smoothed = m_smoothed;
+		variation = m_variation;
+		samples = m_samples;
+	}
+
+	FILE* file = fopen(path, "w");
+	if (file == nullptr)
+		return false;
+	bool ok = fprintf(file, "%.3f %.3f %zu\n", smoothed, variation, samples) > 0;
+	return fclose(file) == 0 && ok;
+};
+
+RoundTripEstimator& RoundTrips()
+{
+	static RoundTripEstimator estimator;
+	return estimator;
+};
+
+uint32_t ReplyTimeout(const ReceiveContext* context, unsigned attempt)
+{
+	uint32_t timeout = RoundTrips().Timeout();
+	for (unsigned i = 1; i < attempt && timeout < RoundTripEstimator::MaximumTimeout; ++i)
+		timeout *= 2;
+	if (timeout > RoundTripEstimator::MaximumTimeout)
+		timeout = RoundTripEstimator::MaximumTimeout;
+	return timeout < context->MinimumTimeout ? context->MinimumTimeout : timeout;
+};
+
+ReceiveStatus AwaitReply(ReceiveContext* context, uint32_t timeout)
+{
+	uint32_t activity = context->Activity.load(std::memory_order_relaxed);
+	while (!context->Event.WaitFor(timeout))
+	{
+		uint32_t latest = context->Activity.load(std::memory_order_relaxed);
+		if (latest == activity)
+			return ReceiveStatus::Timeout;
+		activity = latest;
+	}
+	return context->Status;
+};
+
+bool Transact(ReceiveContext* context, const RetryPolicy& policy)
+{
+	context->Attempt = 0;
+	for (;;)
+	{
+		context->ResetState();
+		SendAndReceive(context);
+		ReceiveStatus status = AwaitReply(context, ReplyTimeout(context, context->Attempt));
+		if (status == ReceiveStatus::Timeout)
+		{
+			// If the callback is already gone the reply made it after all.
+			if (context->InputDevice->RemoveCallback(OnReceived, context))
+				context->Status = ReceiveStatus::Timeout;
+			else
+				context->Event.Wait();
+			status = context->Status;
+		}
+
+		// An overflow would only happen again.
+		if (status == ReceiveStatus::Finished || status == ReceiveStatus::Overflow || context->Attempt >= policy.MaxAttempts)
+			return status == ReceiveStatus::Finished;
+	}
+};
+
+// Sends the dump CalibrationRounds times at the given pacing, without retries.
+static bool TryPacing(InputDevice* input, OutputDevice* output, const uint8_t* dump, size_t cbDump, const OutputPacing& pacing, ProgressCallback callback)
+{
+	output->SetPacing(pacing);
+	ReceiveContext context;
+	context.Initialise(input, output, callback);
+	for (unsigned round = 0; round < CalibrationRounds; ++round)
+	{
+		context.FillSimple(dump, cbDump, 0x24);
+		if (!Transact(&context, RetryPolicy { 1 }))
+		{
+			// Let any late reply arrive now, rather than be taken for the next one's.
+			std::this_thread::sleep_for(std::chrono::milliseconds(RoundTrips().Timeout()));
+			return false;
+		}
+	}
+	return true;
+};
+
+bool CalibratePacing(InputDevice* input, OutputDevice* output, const uint8_t* dump, size_t cbDump, OutputPacing* result, ProgressCallback callback)
+{
+	OutputPacing pacing = output->GetPacing();
+
+	pacing.BytesPerSecond = 0;
+	if (TryPacing(input, output, dump, cbDump, pacing, callback))
+	{
+		*result = pacing;
+		return true;
+	}
+
+	double good = CalibrationMinimumRate;
+	pacing.BytesPerSecond = CalibrationMinimumRate;
+	if (!TryPacing(input, output, dump, cbDump, pacing, callback))
+		return false;
+
+	// Rates span a few orders of magnitude, so bisect on a log scale, to within 10%.
+	double bad = CalibrationMaximumRate;
+	while (bad / good > 1.1)
+	{
+		double rate = std::sqrt(good * bad);
+		pacing.BytesPerSecond = (uint32_t)rate;
+		if (TryPacing(input, output, dump, cbDump, pacing, callback))
+			good = rate;
+		else
+			bad = rate;
+	}
+
+	pacing.BytesPerSecond = (uint32_t)good;
+	output->SetPacing(pacing);
+	*result = pacing;
+	return true;
+};
+
+BufferPool::~BufferPool()
+{
+	for (uint8_t* buffer : m_free)
+		delete[] buffer;
+};
+
+uint8_t* BufferPool::Acquire()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	if (++m_inUse > m_peak)
+		m_peak = m_inUse;
+	if (!m_free.empty())
+	{
+		uint8_t* buffer = m_free.back();
+		m_free.pop_back();
+		return buffer;
+	}
+	++m_allocated;
+	// Reserve for the worst case now so Release never has to allocate.
+	m_free.reserve(m_allocated);
+	return new uint8_t[m_cbBuffer];
+};
+
+void BufferPool::Release(uint8_t* buffer)
+{
+	if (buffer == nullptr)
+		return;
+	std::lock_guard<std::mutex> lock(m_lock);
+	--m_inUse;
+	m_free.push_back(buffer);
+};
+
+size_t BufferPool::InUse()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_inUse;
+};
+
+size_t BufferPool::Peak()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_peak;
+};
+
+size_t BufferPool::Allocated()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_allocated;
+};
+
+BufferPool& ReceiveBuffers()
+{
+	static BufferPool pool;
+	return pool;
+};
+
+BufferPool& BankBuffers()
+{
+	static BufferPool pool(CombiBank::ReceiveBufferSize);
+	return pool;
+};
+
+bool CombiDumpLength::Check(const uint8_t* dump, size_t cbDump)
+{
+	if (cbDump < SysexBuilder::CombiDumpHeaderSize + 2 || dump[0] != 0xF0 || dump[4] != 0x73 || dump[5] != 0x01
+		|| dump[cbDump - 1] != 0xF7)
+		return false;
+
+	std::lock_guard<std::mutex> lock(m_lock);
+	if (m_confirmed)
+		return cbDump == m_length;
+	if (cbDump < m_length)
+		return false;
+	if (cbDump > m_length)
+	{
+		m_length = cbDump;
+		m_agreeing = 0;
+	}
+	m_confirmed = ++m_agreeing >= 2;
+	return m_confirmed;
+};
+
+bool CombiDumpLength::IsKnown()
+{
+	std::lock_guard<std::mutex> lock(m_lock);
+	return m_confirmed;
+};
+
+CombiDumpLength& CombiDumps()
+{
+	static CombiDumpLength length;
+	return length;
+};
+
+CopyPipeline::CopyPipeline(class InputDevice* input, class OutputDevice* output, SysexBuilder& sysex, size_t maxWindow, CombiCache* cache)
+	: m_transactions(input, output)
+	, m_sysex(sysex)
+	, m_cache(cache)
+	, m_maxWindow(maxWindow ? maxWindow : 1)
+	, m_slots(m_maxWindow)
+{ };
+
+size_t CopyPipeline::BanksFetched() const
+{
+	size_t fetched = 0;
+	for (const auto& bank : m_banks)
+		if (bank.IsLoaded())
+			++fetched;
+	return fetched;
+};
+
+bool CopyPipeline::Run(const CopyJob* jobs, size_t count, ProgressCallback callback)
+{
+	std::vector<Slot*> freeSlots;
+	std::deque<Slot*> inFlight;
+	std::vector<JobState>& state = m_state;
+	state.assign(count, JobState {});
+	std::deque<size_t> downloads;
+	std::deque<size_t> uploads;
+	size_t nextJob = 0;
+	size_t uploaded = 0;
+	size_t streak = 0;
+	bool failed = false;
+	// Acknowledgements only carry their function, so a late one for an upload
+	// that timed out would complete whichever upload came next. Uploads go one
+	// at a time, and after one times out the next waits until a late reply to
+	// it would have turned up, as a stray.
+	bool uploading = false;
+	auto quietUntil = std::chrono::steady_clock::time_point {};
+
+	for (auto& slot : m_slots)
+	{
+		slot.Context.Initialise(nullptr, nullptr, callback);
+		freeSlots.push_back(&slot);
+	}
+
+	// Fetch whole banks where that's cheaper than fetching combis one by one.
+	// If a bank dump fails, those combis just get fetched individually.
+	{
+		bool used[256][CombiBank::CombisPerBank] {};
+		size_t touched[256] {};
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (jobs[i].SourceNum < CombiBank::CombisPerBank && !used[jobs[i].SourceBank][jobs[i].SourceNum])
+			{
+				used[jobs[i].SourceBank][jobs[i].SourceNum] = true;
+				++touched[jobs[i].SourceBank];
+			}
+		}
+		// The banks from the last run are fetched into again, keeping their storage.
+		size_t banks = 0;
+		for (size_t bank = 0; bank < 256 && m_bankDumps; ++bank)
+		{
+			if (touched[bank] < BankDumpThreshold)
+				continue;
+			if (banks == m_banks.size())
+				m_banks.emplace_back();
+			if (m_banks[banks].Fetch(m_transactions, m_sysex, (uint8_t)bank, callback))
+				++banks;
+			else
+				++m_errors;
+		}
+		for (size_t i = banks; i < m_banks.size(); ++i)
+			m_banks[i].Reset();
+	}
+
+	while (uploaded < count && !(failed && inFlight.empty()))
+	{
+		// Top the window up. Uploads go first so finished downloads don't pile
+		// up; downloads only run as far ahead as the window allows.
+		while (!failed && inFlight.size() < m_window && !freeSlots.empty())
+		{
+			Slot* slot = freeSlots.back();
+			ReceiveContext& context = slot->Context;
+			if (!uploads.empty() && !uploading && std::chrono::steady_clock::now() >= quietUntil)
+			{
+				slot->Stage = CopyStage::Upload;
+				slot->Job = uploads.front();
+				uploads.pop_front();
+				context.FillSimple(state[slot->Job].Data, state[slot->Job].cbData, 0x24);
+				uploading = true;
+			}
+			else if ((!downloads.empty() || nextJob < count) && uploads.size() < m_window)
+			{
+				if (!downloads.empty())
+				{
+					slot->Job = downloads.front();
+					downloads.pop_front();
+				}
+				else
+					slot->Job = nextJob++;
+
+				const CopyJob& job = jobs[slot->Job];
+				if (state[slot->Job].Data == nullptr)
+					state[slot->Job].Data = ReceiveBuffers().Acquire();
+
+				const CombiBank* bank = nullptr;
+				for (const auto& fetched : m_banks)
+					if (fetched.IsLoaded() && fetched.Bank() == job.SourceBank)
+						bank = &fetched;
+				size_t cbLocal = bank ? bank->Slice(m_sysex, job.SourceNum, state[slot->Job].Data, ReceiveBufferSize) : 0;
+				if (cbLocal == 0 && m_cache
+					&& (cbLocal = m_cache->Load(job.SourceBank, job.SourceNum, state[slot->Job].Data, ReceiveBufferSize)) != 0
+					&& !CombiDumps().Check(state[slot->Job].Data, cbLocal))
+				{
+					// Only known to be bad once the length is; before that it's
+					// just not used.
+					if (CombiDumps().IsKnown())
+						m_cache->Invalidate(job.SourceBank, job.SourceNum);
+					cbLocal = 0;
+				}
+				if (cbLocal)
+				{
+					state[slot->Job].cbData = cbLocal;
+					state[slot->Job].Data[6] = job.DestBank;
+					state[slot->Job].Data[8] = job.DestNum;
+					uploads.push_back(slot->Job);
+					continue;
+				}
+
+				slot->Stage = CopyStage::Download;
+				size_t size = m_sysex.CombiParameterDumpRequest(slot->Request, job.SourceBank, job.SourceNum);
+				context.FillSimple(slot->Request, size, 0x73);
+				context.BufferIn = state[slot->Job].Data;
+				context.cbBufferIn = ReceiveBufferSize;
+			}
+			else
+				break;
+
+			freeSlots.pop_back();
+			inFlight.push_back(slot);
+			context.Attempt = state[slot->Job].Attempts;
+			m_transactions.Send(&context);
+		}
+
+		// Nothing to wait for but the next upload being let through.
+		if (inFlight.empty())
+		{
+			std::this_thread::sleep_until(quietUntil);
+			continue;
+		}
+
+		// The M3 answers in order, so the oldest request is normally the next to
+		// finish. One whose reply was lost times out without upsetting the rest.
+		Slot* slot = inFlight.front();
+		inFlight.pop_front();
+		if (AwaitReply(&slot->Context, ReplyTimeout(&slot->Context, slot->Context.Attempt)) == ReceiveStatus::Timeout
+			&& !m_transactions.Cancel(&slot->Context))
+			slot->Context.Event.Wait();
+		freeSlots.push_back(slot);
+		if (slot->Stage == CopyStage::Upload)
+		{
+			uploading = false;
+			if (slot->Context.Status == ReceiveStatus::Timeout)
+				quietUntil = std::chrono::steady_clock::now() + std::chrono::milliseconds(ReplyTimeout(&slot->Context, slot->Context.Attempt + 1));
+		}
+
+		JobState& job = state[slot->Job];
+		bool finished = slot->Context.Status == ReceiveStatus::Finished;
+		// A dump cut short is no use to upload or cache; it's fetched again. So
+		// is one that came before the length was known, but that's no error.
+		if (finished && slot->Stage == CopyStage::Download && !CombiDumps().Check(job.Data, slot->Context.rxIndex))
+		{
+			finished = false;
+			if (!CombiDumps().IsKnown() && ++job.Attempts < m_retry.MaxAttempts)
+			{
+				downloads.push_front(slot->Job);
+				continue;
+			}
+		}
+		if (finished)
+		{
+			if (slot->Stage == CopyStage::Download)
+			{
+				job.cbData = slot->Context.rxIndex;
+				if (m_cache)
+					m_cache->Store(jobs[slot->Job].SourceBank, jobs[slot->Job].SourceNum, job.Data, job.cbData);
+				job.Data[6] = jobs[slot->Job].DestBank;
+				job.Data[8] = jobs[slot->Job].DestNum;
+				uploads.push_back(slot->Job);
+			}
+			else
+			{
+				ReceiveBuffers().Release(job.Data);
+				job.Data = nullptr;
+				if (m_cache)
+					m_cache->Invalidate(jobs[slot->Job].DestBank, jobs[slot->Job].DestNum);
+				++uploaded;
+			}
+
+			if (++streak >= m_window && m_window < m_maxWindow)
+			{
+				++m_window;
+				streak = 0;
+			}
+			continue;
+		}
+
+		++m_errors;
+		streak = 0;
+		m_window = m_window > 1 ? m_window / 2 : 1;
+		if (++job.Attempts >= m_retry.MaxAttempts)
+		{
+			// Stop issuing, but let whatever is already in flight finish so the
+			// replies don't turn up in the next transfer.
+			failed = true;
+			continue;
+		}
+		// An upload the M3 refused may have been of a bad dump, so that's
+		// fetched again rather than sent as it was. One that timed out is sent again.
+		if (slot->Stage == CopyStage::Upload && slot->Context.Status == ReceiveStatus::Error)
+		{
+			if (m_cache)
+				m_cache->Invalidate(jobs[slot->Job].SourceBank, jobs[slot->Job].SourceNum);
+			downloads.push_front(slot->Job);
+		}
+		else if (slot->Stage == CopyStage::Download)
+			downloads.push_front(slot->Job);
+		else
+			uploads.push_front(slot->Job);
+	}
+
+	for (auto& job : state)
+		ReceiveBuffers().Release(job.Data);
+
+	return !failed;
+};
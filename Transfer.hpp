@@ -0,0 +1,374 @@
+#pragma once
+#include "InputDevice.hpp"
+#include "OutputDevice.hpp"
+#include "SysexBuilder.hpp"
+#include "Event.hpp"
+#include "CombiCache.hpp"
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+struct ReceiveContext;
+
+// What a reply is matched to its request on: the function code, plus the bank
+// and combi number for dumps. Acknowledgements carry neither, so they match
+// any outstanding request expecting that function code.
+struct TransactionKey
+{
+	static constexpr uint8_t AnyBank { 0xFF };
+	static constexpr uint16_t AnySlot { 0xFFFF };
+	static constexpr uint16_t WholeBank { 0x100 };
+
+	uint8_t Function = 0;
+	uint8_t Bank = AnyBank;
+	uint16_t Slot = AnySlot;
+
+	uint32_t Value() const { return ((uint32_t)Function << 24) | ((uint32_t)Bank << 16) | Slot; };
+	bool operator==(const TransactionKey& other) const { return Value() == other.Value(); };
+};
+
+// The key a reply to this request will carry.
+TransactionKey RequestKey(const uint8_t* request, size_t cbRequest, uint8_t expectedFunction);
+// The key of a reply, from at least its first MidiParser::SysexHeadSize bytes.
+// Error replies get the key of the success reply they stand in for, and set
+// *isError.
+TransactionKey ReplyKey(const uint8_t* reply, size_t cbReply, bool* isError);
+
+typedef void (*ProgressCallback)(ReceiveContext*);
+
+enum class ReceiveStatus
+{
+	Idle,
+	Waiting,
+	Receiving,
+	Finished,
+	Overflow,
+	Error,
+	Timeout
+};
+
+struct ReceiveContext
+{
+	class InputDevice* InputDevice;
+	class OutputDevice* OutputDevice;
+	const uint8_t* BufferOut;
+	size_t cbBufferOut;
+	// Optional, sent just before BufferOut: lets a patched header go out ahead
+	// of data that can't be modified in place, such as a mapped library entry.
+	const uint8_t* BufferOutHead = nullptr;
+	size_t cbBufferOutHead = 0;
+	uint8_t expectedFunctionin;
+	uint8_t ReceivedFunction;
+	// Set from the request when it's sent.
+	TransactionKey Key;
+	uint8_t* BufferIn;
+	size_t cbBufferIn;
+	void* UserData;
+	size_t rxIndex = 0;
+	ProgressCallback Callback;
+	class Event Event;
+	ReceiveStatus Status = ReceiveStatus::Idle;
+	// Bumped for every piece of the reply, so a long dump that's still arriving
+	// isn't mistaken for a lost one.
+	std::atomic<uint32_t> Activity { 0 };
+	std::chrono::steady_clock::time_point SentAt;
+	unsigned Attempt = 0;
+	// Only a first attempt sent with nothing ahead of it gives a clean round trip time.
+	bool SampleRoundTrip = false;
+	// Lower bound on the reply timeout in ms, for requests the M3 is slow to
+	// answer such as writing a bank to flash.
+	uint32_t MinimumTimeout = 0;
+	// Called on the input thread in place of signalling Event, for contexts sent
+	// through a TransactionTable.
+	void (*Completed)(ReceiveContext*) = nullptr;
+
+	inline ReceiveContext()
+	{ };
+
+	inline ~ReceiveContext()
+	{ };
+
+	inline void ResetState()
+	{
+		rxIndex = 0;
+		Status = ReceiveStatus::Idle;
+		Event.Reset();
+	};
+
+	inline void Initialise(::InputDevice* input, ::OutputDevice* output, ProgressCallback callback = nullptr)
+	{
+		InputDevice = input;
+		OutputDevice = output;
+		Callback = callback;
+	};
+
+	void FillSimple(const uint8_t* bufferOut, size_t cbBufferOut, uint8_t expectedFunctionIn)
+	{
+		ResetState();
+		BufferOutHead = nullptr;
+		cbBufferOutHead = 0;
+		BufferOut = bufferOut;
+		this->cbBufferOut = cbBufferOut;
+		BufferIn = nullptr;
+		cbBufferIn = 0;
+		this->expectedFunctionin = expectedFunctionIn;
+		Attempt = 0;
+		MinimumTimeout = 0;
+	}
+};
+
+void SendAndReceive(ReceiveContext* context);
+
+// Smoothed round trip time and variation, as TCP keeps them (RFC 6298), from
+// which reply timeouts are derived. Saved between runs so the first transfer
+// of a session doesn't start from a guess.
+class RoundTripEstimator
+{
+public:
+	static constexpr uint32_t InitialTimeout { 1000 };
+	static constexpr uint32_t MinimumTimeout { 100 };
+	static constexpr uint32_t MaximumTimeout { 5000 };
+private:
+	std::mutex m_lock;
+	double m_smoothed = 0;
+	double m_variation = 0;
+	size_t m_samples = 0;
+public:
+	void Sample(double milliseconds);
+	uint32_t Timeout();
+	double Smoothed();
+	double Variation();
+	size_t Samples();
+	bool Load(const char* path);
+	bool Save(const char* path);
+};
+
+RoundTripEstimator& RoundTrips();
+
+// How often to try a transaction before giving up. Every request this tool
+// sends is a dump request or a complete write, so sending one again is harmless.
+struct RetryPolicy
+{
+	unsigned MaxAttempts = 3;
+};
+
+// Storing a bank writes to flash, which keeps the M3 quiet for far longer
+// than any round trip.
+static constexpr uint32_t FlashWriteTimeout { 30000 };
+
+// The time to wait for the next piece of a reply on the given attempt: the
+// estimator's timeout, doubled for each retry.
+uint32_t ReplyTimeout(const ReceiveContext* context, unsigned attempt);
+
+// Waits until the transaction completes or nothing has arrived for timeout ms.
+ReceiveStatus AwaitReply(ReceiveContext* context, uint32_t timeout);
+
+// SendAndReceive, then wait for the reply, sending again after a timeout or a
+// bad reply. Returns true if the transaction finished.
+bool Transact(ReceiveContext* context, const RetryPolicy& policy);
+
+// Finds the fastest pacing at which the device takes a combi dump without
+// errors: unpaced first, then by bisection between CalibrationMinimumRate and
+// CalibrationMaximumRate. The dump has to be one read from the device, and is
+// sent back to the slot it came from, so the device ends up as it was. The
+// output is left paced at the result, keeping its message gap. Returns false
+// if the device fails even at the minimum rate.
+static constexpr uint32_t CalibrationMinimumRate { 3125 }; // DIN MIDI
+static constexpr uint32_t CalibrationMaximumRate { 1000000 };
+static constexpr unsigned CalibrationRounds { 4 };
+bool CalibratePacing(class InputDevice* input, class OutputDevice* output, const uint8_t* dump, size_t cbDump, OutputPacing* result, ProgressCallback callback = nullptr);
+
+// Fixed-size receive buffers, reused between transfers so copying in a loop
+// doesn't go back to the heap once enough buffers exist for the peak load.
+class BufferPool
+{
+public:
+	static constexpr size_t BufferSize { 64 * 1024 };
+private:
+	size_t m_cbBuffer;
+	std::mutex m_lock;
+	std::vector<uint8_t*> m_free;
+	size_t m_inUse = 0;
+	size_t m_peak = 0;
+	size_t m_allocated = 0;
+public:
+	explicit BufferPool(size_t cbBuffer = BufferSize) : m_cbBuffer(cbBuffer) { };
+	BufferPool(const BufferPool&) = delete;
+	BufferPool& operator=(const BufferPool&) = delete;
+	~BufferPool();
+	uint8_t* Acquire();
+	void Release(uint8_t* buffer);
+	size_t InUse();
+	size_t Peak();
+	size_t Allocated();
+	size_t Size() const { return m_cbBuffer; };
+};
+
+// The pool behind every receive buffer in the transfer layer.
+BufferPool& ReceiveBuffers();
+// Buffers big enough for a whole bank dump, for CombiBank::Fetch.
+BufferPool& BankBuffers();
+
+// Holds a buffer from the pool for the life of a transfer.
+class PooledBuffer
+{
+private:
+	BufferPool& m_pool;
+	uint8_t* m_buffer;
+public:
+	inline PooledBuffer(BufferPool& pool = ReceiveBuffers())
+		: m_pool(pool), m_buffer(pool.Acquire())
+	{ };
+	PooledBuffer(const PooledBuffer&) = delete;
+	PooledBuffer& operator=(const PooledBuffer&) = delete;
+	inline ~PooledBuffer() { m_pool.Release(m_buffer); };
+	inline operator uint8_t*() const { return m_buffer; };
+	inline uint8_t* Data() const { return m_buffer; };
+	inline size_t Size() const { return m_pool.Size(); };
+};
+
+// Several transactions in flight on one input/output pair. Each reply goes to
+// the oldest outstanding transaction with the same TransactionKey, whose Event
+// is signalled when it completes. Replies nobody is waiting for, such as the
+// late answer to a request that timed out, are dropped and counted.
+class TransactionTable
+{
+private:
+	class InputDevice* m_input;
+	class OutputDevice* m_output;
+	std::mutex m_lock;
+	std::unordered_map<uint32_t, std::deque<ReceiveContext*>> m_pending;
+	size_t m_outstanding = 0;
+	// The transaction the SysEx currently arriving belongs to, if any.
+	ReceiveContext* m_current = nullptr;
+	size_t m_strays = 0;
+
+	static void OnReceived(void* context, void* sender, MIDIEventArgs& e);
+public:
+	TransactionTable(class InputDevice* input, class OutputDevice* output);
+	~TransactionTable();
+	void Send(ReceiveContext* context);
+	// Takes a transaction that timed out out of the table. Returns false if it
+	// completed in the meantime, in which case its Event is or will be signalled.
+	bool Cancel(ReceiveContext* context);
+	size_t Outstanding();
+	size_t Strays();
+};
+
+// How long a complete single combi dump is. The M3's dumps don't say, so it's
+// learnt from the replies, as the longest single dump seen once two have
+// agreed. Until then no dump can be told from one cut short on the way,
+// so none is fit to use; they're only fetched again.
+class CombiDumpLength
+{
+private:
+	std::mutex m_lock;
+	size_t m_length = 0;
+	unsigned m_agreeing = 0;
+	bool m_confirmed = false;
+public:
+	// Whether dump is a whole single combi dump: its header, an F7h end and
+	// the length whole ones are known to have. While that isn't known yet,
+	// learns from the dump and returns false.
+	bool Check(const uint8_t* dump, size_t cbDump);
+	// Whether the length of whole dumps has been settled.
+	bool IsKnown();
+};
+
+CombiDumpLength& CombiDumps();
+
+// A whole bank of combis fetched with one dump request, so copies that touch
+// most of a bank cost one bank's worth of MIDI bandwidth instead of a round
+// trip per combi. Individual combis are sliced out locally.
+//
+// The reply is taken to be header kind 11h, the bank, then the packed combis
+// back to back. That hasn't been checked against an M3 yet, so nothing that
+// writes to the synth uses it unless asked to.
+class CombiBank
+{
+public:
+	static constexpr size_t CombisPerBank { 128 };
+	static constexpr size_t ReceiveBufferSize { 2 * 1024 * 1024 };
+private:
+	uint8_t m_bank = 0;
+	std::vector<uint8_t> m_data;
+	size_t m_cbCombi = 0;
+public:
+	bool Fetch(TransactionTable& transactions, SysexBuilder& sysex, uint8_t bank, ProgressCallback callback = nullptr);
+	// Builds a single combi dump, as if from CombiParameterDumpRequest.
+	size_t Slice(SysexBuilder& sysex, uint8_t num, uint8_t* buffer, size_t cbBuffer) const;
+	uint8_t Bank() const { return m_bank; };
+	bool IsLoaded() const { return m_cbCombi != 0; };
+	// Marks it unloaded, for when the bank has been written to since.
+	void Reset() { m_cbCombi = 0; };
+	// Unpacked data of one combi, for CombiView.
+	const uint8_t* Combi(uint8_t num) const { return &m_data[num * m_cbCombi]; };
+	size_t CombiSize() const { return m_cbCombi; };
+};
+
+struct CopyJob
+{
+	uint8_t SourceBank, SourceNum;
+	uint8_t DestBank, DestNum;
+};
+
+// Copies a list of combis with the download of later combis overlapping the
+// upload of earlier ones, which go one at a time since their replies can't be
+// told apart. Up to Window() requests are kept in flight; the
+// window grows by one after a window's worth of clean replies and halves on
+// any error or timeout, so it settles at whatever the device keeps up with.
+//
+// With SetBankDumps(true), source banks that BankDumpThreshold or more of the
+// jobs read from are fetched whole up front and sliced locally instead. Combis
+// found in the cache aren't fetched at all.
+class CopyPipeline
+{
+public:
+	static constexpr size_t ReceiveBufferSize { BufferPool::BufferSize };
+	static constexpr size_t BankDumpThreshold { 48 };
+private:
+	enum class CopyStage
+	{
+		Download,
+		Upload
+	};
+	struct Slot
+	{
+		ReceiveContext Context;
+		CopyStage Stage;
+		size_t Job;
+		uint8_t Request[16];
+	};
+	struct JobState
+	{
+		uint8_t* Data = nullptr;
+		size_t cbData = 0;
+		unsigned Attempts = 0;
+	};
+
+	TransactionTable m_transactions;
+	std::vector<CombiBank> m_banks;
+	SysexBuilder& m_sysex;
+	CombiCache* m_cache;
+	size_t m_maxWindow;
+	size_t m_window = 1;
+	size_t m_errors = 0;
+	bool m_bankDumps = false;
+	RetryPolicy m_retry;
+	// Kept between runs along with m_banks, so a pipeline that's run again
+	// reuses them rather than going back to the heap.
+	std::vector<Slot> m_slots;
+	std::vector<JobState> m_state;
+public:
+	CopyPipeline(class InputDevice* input, class OutputDevice* output, SysexBuilder& sysex, size_t maxWindow, CombiCache* cache = nullptr);
+	void SetRetryPolicy(const RetryPolicy& policy) { m_retry = policy; };
+	// Off by default, as CombiBank's layout is unverified.
+	void SetBankDumps(bool enable) { m_bankDumps = enable; };
+	bool Run(const CopyJob* jobs, size_t count, ProgressCallback callback = nullptr);
+	size_t Window() const { return m_window; };
+	size_t Errors() const { return m_errors; };
+	size_t BanksFetched() const;
+};
@@ -2,6 +2,16 @@
 #include "OutputDevice.hpp"
 #include "SysexBuilder.hpp"
 #include "Event.hpp"
+#include "Transfer.hpp"
+#include "Link.hpp"
+#include "CombiLibrary.hpp"
+#include "CombiView.hpp"
+#include "Discovery.hpp"
+#ifdef _UNIX
+#include "M3Emulator.hpp"
+#endif
+#include <vector>
+#include <filesystem>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -10,6 +20,7 @@
 #include <string.h>
 #include <alsa/asoundlib.h>
 static void rawmidi_list(void);
+static void seq_list(void);
 #endif
 
 #ifdef _MSC_VER
@@ -17,17 +28,27 @@ static void rawmidi_list(void);
 #define strcasecmp _stricmp
 #endif
 
-struct ReceiveContext;
-
 InputDevice* s_input;
 OutputDevice* s_output;
+CombiCache s_cache;
+CombiLibrary s_library;
+RetryPolicy s_retry;
+#ifdef _UNIX
+M3Emulator* s_emulator;
+#endif
 
-InputDevice* ChooseInputDevice();
-OutputDevice* ChooseOutputDevice();
+InputDevice* ChooseInputDevice(std::string* name);
+OutputDevice* ChooseOutputDevice(std::string* name);
+bool LoadLastDevices(const char* path, std::string* input, std::string* inputAddress, std::string* output, std::string* outputAddress);
+bool SaveLastDevices(const char* path, const char* input, const char* inputAddress, const char* output, const char* outputAddress);
 void MessageReceived(void* context, void* sender, MIDIEventArgs& e);
-void SendAndReceive(ReceiveContext* context);
 void SysexProgress(ReceiveContext*);
-bool Wait(ReceiveContext*);
+bool SendAndWait(ReceiveContext*);
+bool ReceiveDump(ReceiveContext*);
+size_t LoadCachedDump(uint8_t bank, uint8_t num, uint8_t* buffer, size_t cbBuffer);
+void ReportDumpLength(size_t cbDump);
+bool ReportReply(const Reply& reply, uint8_t expectedFunction);
+Task CopyNext(Link& link, SysexBuilder& sysex, CopyJob job, bool* copied);
 
 #ifdef _WIN32
 BOOL WINAPI ControlHandler(DWORD fdwCtrlType);
@@ -35,100 +56,139 @@ BOOL WINAPI ControlHandler(DWORD fdwCtrlType);
 void ControlHandler(int signo);
 #endif
 
-typedef void (*ProgressCallback)(ReceiveContext*);
-
-enum class ReceiveStatus
+// Picks a device by its number in the device list if one was given, else the
+// one used last time. Returns nullptr if neither is there.
+template <class T>
+static T* SelectDevice(long id, const std::string& lastName, const std::string& lastAddress, std::string* name)
 {
-	Idle,
-	Waiting,
-	Receiving,
-	Finished,
-	Overflow,
-	Error
-};
-
-struct ReceiveContext
-{
-	class InputDevice* InputDevice;
-	class OutputDevice* OutputDevice;
-	const uint8_t* BufferOut;
-	size_t cbBufferOut;
-	uint8_t expectedFunctionin;
-	uint8_t ReceivedFunction;
-	uint8_t* BufferIn;
-	size_t cbBufferIn;
-	void* UserData;
-	size_t rxIndex = 0;
-	ProgressCallback Callback;
-	class Event Event;
-	ReceiveStatus Status = ReceiveStatus::Idle;
-
-	inline ReceiveContext()
-		: Event("SendReceiveEvt")
-	{ };
-
-	inline ~ReceiveContext()
-	{ };
-
-	inline void ResetState()
-	{
-		rxIndex = 0;
-		Status = ReceiveStatus::Idle;
-		//Event.Reset();
-	};
-
-	inline void Initialise(::InputDevice* input, ::OutputDevice* output, ProgressCallback callback = nullptr)
+	char buffer[32];
+	T* device = nullptr;
+	if (id >= 0)
 	{
-		InputDevice = input;
-		OutputDevice = output;
-		Callback = callback;
-	};
-
-	void FillSimple(const uint8_t* bufferOut, size_t cbBufferOut, uint8_t expectedFunctionIn)
+		if ((device = T::GetByID((int)id)) != nullptr && T::GetName((int)id, buffer))
+			*name = buffer;
+		else
+			fprintf(stderr, "There's no device %ld\n", id + 1);
+	}
+	if (device == nullptr && !lastName.empty())
 	{
-		ResetState();
-		BufferOut = bufferOut;
-		this->cbBufferOut = cbBufferOut;
-		BufferIn = nullptr;
-		cbBufferIn = 0;
-		this->expectedFunctionin = expectedFunctionIn;
+		// Opened straight away, so if it has gone the M3 can be looked for elsewhere.
+		if ((device = T::GetByName(lastName.c_str(), lastAddress.c_str())) != nullptr && !device->Open())
+		{
+			delete device;
+			device = nullptr;
+		}
+		else
+			*name = lastName;
 	}
+	return device;
 };
 
 int main(int argc, const char* argv[])
 {
-	rawmidi_list();
-	s_output = OutputDevice::GetByName("M3 1 SOUND");
-	if (s_output == nullptr)
+	// --device N picks input and output N as numbered in the device lists, or
+	// --device IN,OUT each separately.
+	long inputId = -1;
+	long outputId = -1;
+	for (int i = 1; i < argc; ++i)
 	{
-		s_output = ChooseOutputDevice();
-		if (s_output == nullptr)
-			return 1;
+		if (strcmp(argv[i], "--device") == 0 && i + 1 < argc)
+		{
+			char* end;
+			inputId = outputId = strtol(argv[++i], &end, 10) - 1;
+			if (*end == ',')
+				outputId = strtol(end + 1, nullptr, 10) - 1;
+		}
+#ifdef _UNIX
+		// --seq goes through the ALSA sequencer, so other applications can keep
+		// using the M3 while this runs.
+		else if (strcmp(argv[i], "--seq") == 0)
+			Device::SetBackend(DeviceBackend::Sequencer);
+		// --emulate talks to an emulated M3 over the loopback backend instead of
+		// a real one, e.g. to try out fault handling with "emulate".
+		else if (strcmp(argv[i], "--emulate") == 0)
+			Device::SetBackend(DeviceBackend::Loopback);
+#endif
 	}
-	printf("Using output device: %s\n", s_output->Name());
 
-	s_input = InputDevice::GetByName("M3 1 KEYBOARD");
-	if (s_input == nullptr)
+	// Timing and devices remembered from the emulator would be no use with the
+	// M3, and its combis no use in the cache.
+	bool keepState = *s_cache.Directory() != '\0';
+#ifdef _UNIX
+	if (Device::Backend() == DeviceBackend::Loopback)
 	{
-		s_input = ChooseInputDevice();
-		if (s_input == nullptr)
+		Loopback* link = Loopback::Get();
+		if (link == nullptr)
 			return 1;
+		link->Configure({ 1000, 0 });
+		s_emulator = new M3Emulator(link);
+		s_cache.Enable(false);
+		keepState = false;
+	}
+	else if (Device::Backend() == DeviceBackend::Sequencer)
+		seq_list();
+	else
+		rawmidi_list();
+#endif
+
+	// Kept next to the combi cache: the timeouts and devices of last session.
+	std::filesystem::path stateDirectory = std::filesystem::path(s_cache.Directory()).parent_path();
+	std::string timingPath = (stateDirectory / "timing").string();
+	std::string devicesPath = (stateDirectory / "devices").string();
+	std::string lastInput, lastInputAddress, lastOutput, lastOutputAddress;
+	if (keepState)
+		LoadLastDevices(devicesPath.c_str(), &lastInput, &lastInputAddress, &lastOutput, &lastOutputAddress);
+
+	std::string outputName, inputName;
+	s_output = SelectDevice<OutputDevice>(outputId, lastOutput, lastOutputAddress, &outputName);
+	s_input = SelectDevice<InputDevice>(inputId, lastInput, lastInputAddress, &inputName);
+	if (s_output == nullptr || s_input == nullptr)
+	{
+		delete s_output;
+		delete s_input;
+		s_output = nullptr;
+		s_input = nullptr;
+
+		DiscoveredDevice found;
+		if (DiscoverM3(&found))
+		{
+			s_output = found.Output;
+			s_input = found.Input;
+			outputName = found.OutputName;
+			inputName = found.InputName;
+			printf("Found M3 (member %04X, version %u.%u.%u.%u)\n", found.Member, found.Version[0], found.Version[1], found.Version[2], found.Version[3]);
+		}
+		else
+			printf("No M3 answered an identity request\n");
 	}
+	if (s_output == nullptr && (s_output = ChooseOutputDevice(&outputName)) == nullptr)
+		return 1;
+	printf("Using output device: %s\n", s_output->Name());
+	if (s_input == nullptr && (s_input = ChooseInputDevice(&inputName)) == nullptr)
+		return 1;
 	printf("Using input device: %s\n", s_input->Name());
 
-	if (s_input->Open())
+	bool inputOpen = s_input->Open();
+	if (inputOpen)
 		printf("Input device opened OK\n");
 	else
 		fprintf(stderr, "Failed opening input device\n");
 
-	if (s_output->Open())
+	bool outputOpen = s_output->Open();
+	if (outputOpen)
 		printf("Output device opened OK\n");
 	else
 		fprintf(stderr, "Failed opening output device\n");
 
-	s_input->AddCallback(MessageReceived);
+	if (inputOpen && outputOpen && keepState)
+		SaveLastDevices(devicesPath.c_str(), inputName.c_str(), s_input->Name(), outputName.c_str(), s_output->Name());
+
+	s_input->AddCallback(MessageReceived, nullptr, MessageFilter::All().Remove(SystemMessageType::TimingClock).Remove(SystemMessageType::ActiveSensing));
 	s_input->StartReceiveDump(1024);
 
+	if (keepState)
+		RoundTrips().Load(timingPath.c_str());
+
 	SysexBuilder sysex(0);
 
 #ifdef _WIN32
@@ -142,10 +202,14 @@ int main(int argc, const char* argv[])
 	uint8_t copydest_num  = 0;
 	uint8_t copysrc_bank  = 0;
 	uint8_t copysrc_num   = 0;
+	size_t  copy_window   = 4;
+	bool    bank_dumps    = false;
 
 	ReceiveContext context {};
 	context.Initialise(s_input, s_output, SysexProgress);
 
+	CombiBank listedBank;
+
 	while (true)
 	{
 		char input[256];
@@ -190,7 +254,54 @@ int main(int argc, const char* argv[])
 			printf("          'cancel' will stop the sequential copy without committing to non-volatile memory.\n");
 			printf("    copyseq [startnum]  Start a sequential copy, optionally with the first destination at the given patch number.\n");
 			printf("\n");
+			printf("copybatch Like copyseq, but collects all the source patches first and copies them in one go,\n");
+			printf("          overlapping downloads and uploads. Several source patches may be entered per line.\n");
+			printf("          Enter 'done'/'stop'/'quit'/'exit' to start copying, or 'cancel' to copy nothing.\n");
+			printf("    copybatch [startnum]\n");
+			printf("\n");
+			printf("window    Set the maximum number of requests copybatch keeps in flight (default 4).\n");
+			printf("    window N\n");
+			printf("\n");
+			printf("retries   Set how many times a request is sent before giving up (default 3).\n");
+			printf("    retries N\n");
+			printf("\n");
+			printf("bankdump  Let copybatch fetch whole source banks when it reads most of one. The bank dump\n");
+			printf("          layout is unverified on a real M3, so this is experimental.\n");
+			printf("    bankdump on|off  (default off)\n");
+			printf("\n");
 			printf("copynext\n");
+			printf("\n");
+			printf("cache     Control the on-disk cache of downloaded combis. Writing to a slot drops it from the cache.\n");
+			printf("    cache on|off     Use the cache for copies (default on)\n");
+			printf("    cache clear      Forget every cached combi\n");
+			printf("\n");
+			printf("libsave   Save every cached combi into a combi library file.\n");
+			printf("    libsave <file>\n");
+			printf("\n");
+			printf("libopen   Open a combi library file to upload from.\n");
+			printf("    libopen <file>\n");
+			printf("\n");
+			printf("libupload Upload a combi from the open library (source bank set by copysrc) to the next destination patch.\n");
+			printf("    libupload [srcnum]\n");
+			printf("\n");
+			printf("list      List the names of the combis in the source bank. The bank is fetched once and kept.\n");
+			printf("    list [refresh]   Fetch the bank again first\n");
+			printf("\n");
+			printf("pace      Limit how fast data is sent, for when the M3 reports packet errors.\n");
+			printf("    pace             Show the current pacing\n");
+			printf("    pace off         Send as fast as possible\n");
+			printf("    pace RATE [GAP]  Send at most RATE bytes/s, leaving GAP microseconds after each SysEx\n");
+			printf("\n");
+			printf("calibrate Find the fastest pacing the M3 keeps up with, by sending the source patch back to itself.\n");
+			printf("\n");
+			printf("stats     Show receive queue, buffer and round trip statistics.\n");
+			printf("\n");
+			printf("reconnect Close and reopen the MIDI devices, e.g. after unplugging the M3 and plugging it back in.\n");
+#ifdef _UNIX
+			printf("\n");
+			printf("emulate   With --emulate, show what the emulated M3 has answered.\n");
+			printf("    emulate DROP NAK TRUNC [SEED]  Drop, NAK or truncate the given percentage of replies\n");
+#endif
 			printf("\n");
 			printf("exit|quit Exits the program\n");
 		}
@@ -200,8 +311,7 @@ int main(int argc, const char* argv[])
 			{
 				size_t size = sysex.ModeChange(message, 0);
 				context.FillSimple(message, size, 0x24);
-				SendAndReceive(&context);
-				Wait(&context);
+				SendAndWait(&context);
 			}
 		}
 		else if (strncasecmp("copysrc ", input, 8) == 0)
@@ -317,20 +427,27 @@ int main(int argc, const char* argv[])
 				fflush(stdout);
 
 				size_t size = sysex.CombiParameterDumpRequest(message, copysrc_bank, copysrc_num);
-				uint8_t* combiData = new uint8_t[64 * 1024];
+				PooledBuffer combiData;
 				ReceiveContext context{};
 				context.InputDevice = s_input;
 				context.OutputDevice = s_output;
 				context.BufferIn = combiData;
 				context.BufferOut = message;
-				context.cbBufferIn = 64 * 1024;
+				context.cbBufferIn = combiData.Size();
 				context.cbBufferOut = size;
 				context.expectedFunctionin = 0x73;
 				context.Callback = &SysexProgress;
 
-				SendAndReceive(&context);
-				if (!Wait(&context))
-					goto CopyseqError;
+				size_t bytesReceived = LoadCachedDump(copysrc_bank, copysrc_num, combiData, combiData.Size());
+				if (bytesReceived)
+					printf(" (cached) OK\n");
+				else
+				{
+					if (!ReceiveDump(&context))
+						goto CopyseqError;
+					bytesReceived = context.rxIndex;
+					s_cache.Store(copysrc_bank, copysrc_num, combiData, bytesReceived);
+				}
 				#pragma endregion
 
 				#pragma region Upload data
@@ -338,14 +455,13 @@ int main(int argc, const char* argv[])
 				combiData[6] = copydest_bank;
 				combiData[8] = copydest_num;
 
-				{
-					size_t bytesReceived = context.rxIndex;
-					context.ResetState();
-					context.FillSimple(combiData, bytesReceived, 0x24);
-				}
-				SendAndReceive(&context);
-				if (!Wait(&context))
+				context.ResetState();
+				context.FillSimple(combiData, bytesReceived, 0x24);
+				if (listedBank.Bank() == copydest_bank)
+					listedBank.Reset();
+				if (!SendAndWait(&context))
 					goto CopyseqError;
+				s_cache.Invalidate(copydest_bank, copydest_num);
 				#pragma endregion
 
 
@@ -360,167 +476,416 @@ int main(int argc, const char* argv[])
 				printf("Saving");
 				size_t size = sysex.StoreCombinationBank(message, copydest_bank);
 				context.FillSimple(message, size, 0x24);
-				SendAndReceive(&context);
-				Wait(&context);
+				context.MinimumTimeout = FlashWriteTimeout;
+				SendAndWait(&context);
 			}
 			#pragma endregion
 
 		CopyseqCancel:
 			continue;
 		}
+		else if (strncasecmp("copybatch", input, 9) == 0)
+		{
+			if (cchInput > 9)
+				copydest_num = strtoul(&input[9], nullptr, 10);
+
+			std::vector<CopyJob> jobs;
+			for (;;)
+			{
+				printf("%03zu < ", copydest_num + jobs.size());
+				fflush(stdout);
+
+				if (fgets(input, 256, stdin) == nullptr)
+					break;
+
+				cchInput = strnlen(input, 255);
+				if (cchInput > 0 && input[cchInput - 1] == '\n')
+				{
+					input[cchInput - 1] = '\0';
+					--cchInput;
+				}
+
+				if (cchInput >= 4)
+				{
+					if (strncasecmp(input, "cancel", 6) == 0)
+						goto CopybatchCancel;
+					if (strncasecmp(input, "done", 4) == 0 || strncasecmp(input, "stop", 4) == 0
+						|| strncasecmp(input, "quit", 4) == 0 || strncasecmp(input, "exit", 4) == 0)
+						break;
+				}
+
+				char* p = input;
+				do
+				{
+					char* end;
+					unsigned long num = strtoul(p, &end, 10);
+					if (end != p)
+						copysrc_num = num;
+					else if (cchInput > 0)
+						break;
+					jobs.push_back(CopyJob { copysrc_bank, copysrc_num, copydest_bank, (uint8_t)(copydest_num + jobs.size()) });
+					copysrc_num++;
+					p = end;
+				} while (cchInput > 0);
+			}
+
+			if (jobs.empty())
+				continue;
+
+			{
+				printf("Copying %zu combis", jobs.size());
+				fflush(stdout);
+				CopyPipeline pipeline(s_input, s_output, sysex, copy_window, &s_cache);
+				pipeline.SetRetryPolicy(s_retry);
+				pipeline.SetBankDumps(bank_dumps);
+				bool copied = pipeline.Run(jobs.data(), jobs.size(), SysexProgress);
+				// Even a failed copy may have written some of them.
+				if (listedBank.Bank() == copydest_bank)
+					listedBank.Reset();
+				if (!copied)
+				{
+					printf("Copy failed after %zu errors\n", pipeline.Errors());
+					continue;
+				}
+				printf("OK (window %zu, %zu whole banks fetched, %zu errors)\n", pipeline.Window(), pipeline.BanksFetched(), pipeline.Errors());
+				copydest_num += jobs.size();
+			}
+
+			printf("Saving");
+			{
+				size_t size = sysex.StoreCombinationBank(message, copydest_bank);
+				context.FillSimple(message, size, 0x24);
+				context.MinimumTimeout = FlashWriteTimeout;
+				SendAndWait(&context);
+			}
+
+		CopybatchCancel:
+			continue;
+		}
+		else if (strncasecmp("window ", input, 7) == 0)
+		{
+			size_t window = strtoul(&input[7], nullptr, 10);
+			if (window == 0)
+				fprintf(stderr, "Invalid input. e.g., window 4\n");
+			else
+				copy_window = window;
+		}
+		else if (strncasecmp("retries ", input, 8) == 0)
+		{
+			unsigned attempts = strtoul(&input[8], nullptr, 10);
+			if (attempts == 0)
+				fprintf(stderr, "Invalid input. e.g., retries 3\n");
+			else
+				s_retry.MaxAttempts = attempts;
+		}
+		else if (strncasecmp("bankdump", input, 8) == 0)
+		{
+			if (strcasecmp("bankdump on", input) == 0)
+				bank_dumps = true;
+			else if (strcasecmp("bankdump off", input) == 0)
+				bank_dumps = false;
+			printf("Whole bank dumps %s\n", bank_dumps ? "on (experimental)" : "off");
+		}
 		else if (strncasecmp("copynext", input, 8) == 0)
 		{
 			if (cchInput > 8)
 				copysrc_num = strtoul(&input[9], nullptr, 10);
 
 			printf("Copying from %d:%d to %d:%d\n", copysrc_bank, copysrc_num, copydest_bank, copydest_num);
-			printf("Receiving");
-			fflush(stdout);
 
-			size_t size = sysex.CombiParameterDumpRequest(message, copysrc_bank, copysrc_num);
-			uint8_t* combiData = new uint8_t[64 * 1024];
-			ReceiveContext context {};
-			context.InputDevice = s_input;
-			context.OutputDevice = s_output;
-			context.BufferIn = combiData;
-			context.BufferOut = message;
-			context.cbBufferIn = 64 * 1024;
-			context.cbBufferOut = size;
-			context.expectedFunctionin = 0x73;
-			context.Callback = &SysexProgress;
+			bool copied = false;
+			Link link(s_input, s_output);
+			link.SetRetryPolicy(s_retry);
+			link.SetProgress(SysexProgress);
+			link.Run(CopyNext(link, sysex, CopyJob { copysrc_bank, copysrc_num, copydest_bank, copydest_num }, &copied));
+			if (listedBank.Bank() == copydest_bank)
+				listedBank.Reset();
+			if (copied)
+			{
+				copysrc_num++;
+				copydest_num++;
+			}
+		}
+		else if (strncasecmp("cache", input, 5) == 0)
+		{
+			if (strcasecmp("cache on", input) == 0)
+				s_cache.Enable(true);
+			else if (strcasecmp("cache off", input) == 0)
+				s_cache.Enable(false);
+			else if (strcasecmp("cache clear", input) == 0)
+				s_cache.Clear();
+			printf("Combi cache %s (%s)\n", s_cache.IsEnabled() ? "on" : "off", s_cache.Directory());
+		}
+		else if (strncasecmp("libsave ", input, 8) == 0)
+		{
+			CombiLibraryWriter writer;
+			PooledBuffer combiData;
+			for (size_t slot = 0; slot < LibrarySlotCount; ++slot)
+			{
+				uint8_t bank = (uint8_t)((((slot / 128) & 8) << 3) | ((slot / 128) & 7));
+				size_t size = s_cache.Load(bank, slot % 128, combiData, combiData.Size());
+				if (size)
+					writer.Add(bank, slot % 128, combiData, size);
+			}
 
-			SendAndReceive(&context);
-			context.Event.Wait();
+			if (writer.Save(&input[8]))
+				printf("Saved %zu combis to %s\n", writer.Count(), &input[8]);
+			else
+				fprintf(stderr, "Couldn't write combi library '%s'\n", &input[8]);
+		}
+		else if (strncasecmp("libopen ", input, 8) == 0)
+		{
+			if (s_library.Open(&input[8]))
+				printf("Opened %s: %zu combis\n", &input[8], s_library.Count());
+			else
+				fprintf(stderr, "Couldn't open combi library '%s'\n", &input[8]);
+		}
+		else if (strncasecmp("libupload", input, 9) == 0)
+		{
+			if (cchInput > 9)
+				copysrc_num = strtoul(&input[10], nullptr, 10);
 
-			switch (context.Status)
+			size_t cbDump;
+			const uint8_t* dump = s_library.Get(copysrc_bank, copysrc_num, &cbDump);
+			if (dump == nullptr)
 			{
-				case ReceiveStatus::Finished:
-					printf("OK\n");
-					break;
-				case ReceiveStatus::Overflow:
-					printf("Data overflow error\n");
-					goto CopynextError;
-				case ReceiveStatus::Error:
-					printf("Packet error\n");
-					goto CopynextError;
+				fprintf(stderr, "No combi %d:%d in the library\n", copysrc_bank, copysrc_num);
+				continue;
 			}
 
-			printf("Saving");
-			combiData[6] = copydest_bank;
-			combiData[8] = copydest_num;
+			printf("Uploading %d:%d from library to %d:%d", copysrc_bank, copysrc_num, copydest_bank, copydest_num);
+			fflush(stdout);
 
+			// Only the header needs patching; the rest goes straight from the mapping.
+			uint8_t header[SysexBuilder::CombiDumpHeaderSize];
+			memcpy(header, dump, sizeof(header));
+			header[6] = copydest_bank;
+			header[8] = copydest_num;
+			context.FillSimple(dump + sizeof(header), cbDump - sizeof(header), 0x24);
+			context.BufferOutHead = header;
+			context.cbBufferOutHead = sizeof(header);
+			bool uploaded = SendAndWait(&context);
+			if (listedBank.Bank() == copydest_bank)
+				listedBank.Reset();
+			if (uploaded)
 			{
-				size_t bytesReceived = context.rxIndex;
-				context.ResetState();
-				context.FillSimple(combiData, bytesReceived, 0x24);
+				s_cache.Invalidate(copydest_bank, copydest_num);
+				copysrc_num++;
+				copydest_num++;
+			}
+		}
+		else if (strncasecmp("list", input, 4) == 0 && (input[4] == '\0' || input[4] == ' '))
+		{
+			if (!listedBank.IsLoaded() || listedBank.Bank() != copysrc_bank || strcasecmp("list refresh", input) == 0)
+			{
+				printf("Receiving");
+				fflush(stdout);
+				TransactionTable transactions(s_input, s_output);
+				if (!listedBank.Fetch(transactions, sysex, copysrc_bank, SysexProgress))
+				{
+					printf("Couldn't fetch bank %d\n", copysrc_bank);
+					continue;
+				}
+				printf("OK\n");
 			}
-			SendAndReceive(&context);
-			context.Event.Wait();
 
-			switch (context.Status)
+			if (!CombiView(listedBank.Combi(0), listedBank.CombiSize()).IsValid())
 			{
-				case ReceiveStatus::Finished:
-					printf("OK\n");
-					break;
-				case ReceiveStatus::Overflow:
-					printf("Data overflow error\n");
-					goto CopynextError;
-				case ReceiveStatus::Error:
-					printf("Packet error\n");
-					goto CopynextError;
+				printf("Combis in bank %d are too short (%zu bytes)\n", copysrc_bank, listedBank.CombiSize());
+				continue;
 			}
 
-			copysrc_num++;
-			copydest_num++;
-		CopynextError:
-			continue;
+			for (uint8_t num = 0; num < CombiBank::CombisPerBank; ++num)
+			{
+				CombiView combi(listedBank.Combi(num), listedBank.CombiSize());
+				std::string_view name = combi.Name();
+				printf("%03d %-*.*s%s", num, (int)CombiView::NameLength, (int)name.size(), name.data(), num % 4 == 3 ? "\n" : "  ");
+			}
+		}
+		else if (strncasecmp("pace", input, 4) == 0 && (input[4] == '\0' || input[4] == ' '))
+		{
+			OutputPacing pacing = s_output->GetPacing();
+			if (strcasecmp("pace off", input) == 0)
+				pacing = OutputPacing {};
+			else if (input[4] == ' ')
+			{
+				char* end;
+				pacing.BytesPerSecond = strtoul(&input[5], &end, 10);
+				pacing.MessageGapMicroseconds = strtoul(end, nullptr, 10);
+			}
+			s_output->SetPacing(pacing);
+			if (pacing.BytesPerSecond)
+				printf("Sending at most %u bytes/s", pacing.BytesPerSecond);
+			else
+				printf("Sending unpaced");
+			printf(", %u us between messages\n", pacing.MessageGapMicroseconds);
+		}
+		else if (strcasecmp("calibrate", input) == 0)
+		{
+			printf("Receiving %d:%d", copysrc_bank, copysrc_num);
+			fflush(stdout);
+			// Always from the device, not the cache: calibrating writes it back,
+			// and a cached copy could predate edits made on the M3 itself.
+			PooledBuffer combiData;
+			context.FillSimple(message, sysex.CombiParameterDumpRequest(message, copysrc_bank, copysrc_num), 0x73);
+			context.BufferIn = combiData;
+			context.cbBufferIn = combiData.Size();
+			if (!ReceiveDump(&context))
+				continue;
+			size_t size = context.rxIndex;
+
+			printf("Calibrating");
+			fflush(stdout);
+			OutputPacing pacing;
+			if (!CalibratePacing(s_input, s_output, combiData, size, &pacing, SysexProgress))
+				printf("Failed even at %u bytes/s\n", CalibrationMinimumRate);
+			else if (pacing.BytesPerSecond)
+				printf("OK, %u bytes/s\n", pacing.BytesPerSecond);
+			else
+				printf("OK, no pacing needed\n");
 		}
+		else if (strcasecmp("reconnect", input) == 0)
+		{
+			// Devices are looked up again by name on opening, so this finds the
+			// M3 even if it came back as a different card.
+			s_input->Close();
+			s_output->Close();
+			if (s_input->Open() && s_output->Open())
+				printf("OK\n");
+			else
+				fprintf(stderr, "Failed reopening the MIDI devices\n");
+		}
+		else if (strcasecmp("stats", input) == 0)
+		{
+			InputStatistics stats;
+			if (s_input->GetStatistics(&stats))
+				printf("Receive queue: %zu/%zu slots at peak, reader waited for room %zu times\n", stats.QueueHighWater, stats.QueueSize, stats.ReaderStalls);
+			else
+				printf("No receive statistics for this device\n");
+			OutputStatistics output;
+			if (s_output->GetStatistics(&output))
+			{
+				printf("Send queue: %zu/%zu bytes queued, %zu at peak, %llu bytes sent, %llu partial writes; stalled %.1f ms on the device, senders %.1f ms\n",
+					output.QueuedBytes, output.QueueSize, output.QueueHighWater, (unsigned long long)output.BytesWritten, (unsigned long long)output.PartialWrites,
+					output.WriterStallMicroseconds / 1000.0, output.ProducerStallMicroseconds / 1000.0);
+				if (output.PacingDelayMicroseconds)
+					printf("Pacing held the send queue back for %.1f ms\n", output.PacingDelayMicroseconds / 1000.0);
+			}
+			printf("Receive buffers: %zu in use, %zu at peak, %zu allocated\n", ReceiveBuffers().InUse(), ReceiveBuffers().Peak(), ReceiveBuffers().Allocated());
+			printf("Round trip: %.1f ms, variation %.1f ms over %zu samples; reply timeout %u ms\n",
+				RoundTrips().Smoothed(), RoundTrips().Variation(), RoundTrips().Samples(), RoundTrips().Timeout());
+		}
+#ifdef _UNIX
+		else if (strncasecmp("emulate", input, 7) == 0 && (input[7] == '\0' || input[7] == ' '))
+		{
+			if (s_emulator == nullptr)
+			{
+				printf("Not running with --emulate\n");
+				continue;
+			}
+			if (input[7] == ' ')
+			{
+				EmulatorFaults faults;
+				char* end;
+				faults.Drop = strtod(&input[8], &end) / 100;
+				faults.Nak = strtod(end, &end) / 100;
+				faults.Truncate = strtod(end, &end) / 100;
+				if (*end)
+					faults.Seed = strtoul(end, nullptr, 10);
+				s_emulator->SetFaults(faults);
+			}
+			EmulatorStatistics stats = s_emulator->Statistics();
+			printf("Emulated M3: %llu requests, %llu dropped, %llu NAKed, %llu truncated, %llu ignored\n",
+				(unsigned long long)stats.Requests, (unsigned long long)stats.Dropped, (unsigned long long)stats.Naks,
+				(unsigned long long)stats.Truncated, (unsigned long long)stats.Ignored);
+		}
+#endif
 		else if (strcasecmp("exit", input) == 0 || strcasecmp("quit", input) == 0)
 			break;
 	}
 
 	printf("Cleaning up . . .\n");
+	if (keepState)
+		RoundTrips().Save(timingPath.c_str());
 	s_input->Close();
 	s_output->Close();
 
 	delete s_input;
 	delete s_output;
+#ifdef _UNIX
+	delete s_emulator;
+#endif
 
 	return 0;
 };
 
 
-void OnReceived(void* context_, void* sender, MIDIEventArgs& e)
+bool ReportReply(const Reply& reply, uint8_t expectedFunction)
 {
-	if (e.Message.Status != 0xF0)
-		return;
+	switch (reply.Status())
+	{
+	case ReceiveStatus::Finished:
+		printf("OK\n");
+		return true;
+	case ReceiveStatus::Overflow:
+		printf("Overflow error\n");
+		return false;
+	case ReceiveStatus::Error:
+		printf("Packet error (Expected %02Xh, got %02Xh)\n", expectedFunction, reply.Size() > 4 ? reply.Data()[4] : 0);
+		return false;
+	case ReceiveStatus::Timeout:
+		printf("No reply\n");
+		return false;
+	default:
+		printf("Unexpected state\n");
+		return false;
+	}
+};
 
-	size_t cbBuffer = e.Message.BufferSize;
-	ReceiveContext* context = (ReceiveContext*)context_;
+Task CopyNext(Link& link, SysexBuilder& sysex, CopyJob job, bool* copied)
+{
+	printf("Receiving");
+	fflush(stdout);
 
-	if (context->Status == ReceiveStatus::Waiting)
+	uint8_t request[16];
+	PooledBuffer cached;
+	size_t size = LoadCachedDump(job.SourceBank, job.SourceNum, cached, cached.Size());
+	Reply download(ReceiveStatus::Finished, nullptr, 0);
+	if (size)
+		printf(" (cached) OK\n");
+	// A dump cut short is fetched again, as a lost one would be.
+	for (unsigned attempt = 1; size == 0; ++attempt)
 	{
-		if (e.Message.BufferSize < 6)
-		{
-			context->Status = ReceiveStatus::Error;
-			context->InputDevice->RemoveCallback(OnReceived, context_);
-			if (context->Callback)
-				context->Callback(context);
-			context->Event.Signal();
-			return;
-		}
-		context->ReceivedFunction = e.Message.Buffer[4];
-		if (context->ReceivedFunction != context->expectedFunctionin)
-		{
-			context->Status = ReceiveStatus::Error;
-			context->InputDevice->RemoveCallback(OnReceived, context_);
-			if (context->Callback)
-				context->Callback(context);
-			context->Event.Signal();
-			return;
+		download = co_await link.Request(request, sysex.CombiParameterDumpRequest(request, job.SourceBank, job.SourceNum), 0x73);
+		if (!ReportReply(download, 0x73))
+			co_return;
+		if (CombiDumps().Check(download.Data(), download.Size()))
+		{
+			size = download.Size();
+			s_cache.Store(job.SourceBank, job.SourceNum, download.Data(), size);
+			break;
 		}
-
-		if (context->BufferIn == nullptr)
+		ReportDumpLength(download.Size());
+		if (attempt >= s_retry.MaxAttempts)
 		{
-			context->Status = ReceiveStatus::Finished;
-			context->InputDevice->RemoveCallback(OnReceived, context_);
-			if (context->Callback)
-				context->Callback(context);
-			context->Event.Signal();
-			return;
+			printf("\n");
+			co_return;
 		}
-
-		context->Status = ReceiveStatus::Receiving;
-	}
-
-
-	if (cbBuffer > context->cbBufferIn - context->rxIndex)
-		cbBuffer = context->cbBufferIn - context->rxIndex;
-	memcpy(context->BufferIn + context->rxIndex, e.Message.Buffer, cbBuffer);
-	context->rxIndex += cbBuffer;
-	if (e.Message.BufferSize > 0 && e.Message.Buffer[e.Message.BufferSize - 1] == 0xF7)
-	{
-		context->Status = ReceiveStatus::Finished;
-		context->InputDevice->RemoveCallback(OnReceived, context_);
-	}
-	else if (context->rxIndex == context->cbBufferIn)
-	{
-		context->Status = ReceiveStatus::Overflow;
-		context->InputDevice->RemoveCallback(OnReceived, context_);
+		printf(", receiving again");
+		fflush(stdout);
 	}
 
-	if (context->Callback)
-		context->Callback(context);
-
-	if (context->Status != ReceiveStatus::Receiving)
-		context->Event.Signal();
-};
-
-void SendAndReceive(ReceiveContext* context)
-{
-	context->Status = ReceiveStatus::Waiting;
-	context->InputDevice->AddCallback(OnReceived, context);
-	context->OutputDevice->LongMessage(context->BufferOut, context->cbBufferOut);
+	printf("Saving");
+	fflush(stdout);
+	uint8_t* combiData = download.Data() ? download.Data() : cached.Data();
+	combiData[6] = job.DestBank;
+	combiData[8] = job.DestNum;
+	Reply saved = co_await link.Request(combiData, size, 0x24);
+	if (!ReportReply(saved, 0x24))
+		co_return;
+
+	s_cache.Invalidate(job.DestBank, job.DestNum);
+	*copied = true;
 };
 
 void SysexProgress(ReceiveContext*)
@@ -529,21 +894,16 @@ void SysexProgress(ReceiveContext*)
 	fflush(stdout);
 };
 
-InputDevice* ChooseInputDevice()
+InputDevice* ChooseInputDevice(std::string* chosen)
 {
 	auto nInputDevices = InputDevice::Count();
 	printf("%zu input devices:\n", nInputDevices);
 	char name[32];
-	DeviceEnumerator device {};
-	int i = -1;
-	while (InputDevice::EnumerateNext(&device))
+	for (size_t i = 0; i < nInputDevices; ++i)
 	{
-		++i;
-		if (InputDevice::GetName(&device, name, sizeof(name)))
+		if (InputDevice::GetName((int)i, name))
 			printf("  [%zu]: %s\n", i+1, name);
-
 	}
-	InputDevice::StopEnumeration(&device);
 
 	printf("Enter a device number: ");
 	fflush(stdout);
@@ -554,24 +914,21 @@ InputDevice* ChooseInputDevice()
 	if ((id = strtoul(name, nullptr, 10)) <= 0)
 		return nullptr;
 
-	return nullptr;
+	if (InputDevice::GetName(id - 1, name))
+		*chosen = name;
 	return InputDevice::GetByID(id - 1);
 };
 
-OutputDevice* ChooseOutputDevice()
+OutputDevice* ChooseOutputDevice(std::string* chosen)
 {
 	auto nOutputDevices = OutputDevice::Count();
 	printf("%zu output devices:\n", nOutputDevices);
 	char name[32];
-	DeviceEnumerator device {};
-	int i = -1;
-	while (OutputDevice::EnumerateNext(&device))
+	for (size_t i = 0; i < nOutputDevices; ++i)
 	{
-		++i;
-		if (OutputDevice::GetName(&device, name, sizeof(name)))
+		if (OutputDevice::GetName((int)i, name))
 			printf("  [%zu]: %s\n", i+1, name);
 	}
-	OutputDevice::StopEnumeration(&device);
 
 	printf("Enter a device number: ");
 	fflush(stdout);
@@ -582,18 +939,86 @@ OutputDevice* ChooseOutputDevice()
 	if ((id = strtoul(name, nullptr, 10)) <= 0)
 		return nullptr;
 
+	if (OutputDevice::GetName(id - 1, name))
+		*chosen = name;
 	return OutputDevice::GetByID(id - 1);
 };
 
+// One line per direction and backend:
+//   <backend> input|output <address> <name>
+// Lines for the other backend are kept for when it's used again.
+static const char* BackendName()
+{
+	switch (Device::Backend())
+	{
+	case DeviceBackend::Sequencer:
+		return "seq";
+	case DeviceBackend::Loopback:
+		return "loopback";
+	default:
+		return "rawmidi";
+	}
+};
+
+bool LoadLastDevices(const char* path, std::string* input, std::string* inputAddress, std::string* output, std::string* outputAddress)
+{
+	FILE* file = fopen(path, "r");
+	if (file == nullptr)
+		return false;
+
+	char line[256];
+	char backend[16], direction[16], address[64], name[128];
+	while (fgets(line, sizeof(line), file))
+	{
+		if (sscanf(line, "%15s %15s %63s %127[^\n]", backend, direction, address, name) != 4 || strcmp(backend, BackendName()) != 0)
+			continue;
+		if (strcmp(direction, "input") == 0)
+		{
+			*input = name;
+			*inputAddress = address;
+		}
+		else if (strcmp(direction, "output") == 0)
+		{
+			*output = name;
+			*outputAddress = address;
+		}
+	}
+	fclose(file);
+	return !input->empty() || !output->empty();
+};
+
+bool SaveLastDevices(const char* path, const char* input, const char* inputAddress, const char* output, const char* outputAddress)
+{
+	std::vector<std::string> kept;
+	char line[256];
+	char backend[16];
+	FILE* file = fopen(path, "r");
+	if (file != nullptr)
+	{
+		while (fgets(line, sizeof(line), file))
+			if (sscanf(line, "%15s", backend) == 1 && strcmp(backend, BackendName()) != 0)
+				kept.push_back(line);
+		fclose(file);
+	}
+
+	if ((file = fopen(path, "w")) == nullptr)
+		return false;
+	for (const auto& other : kept)
+		fputs(other.c_str(), file);
+	fprintf(file, "%s input %s %s\n", BackendName(), inputAddress, input);
+	fprintf(file, "%s output %s %s\n", BackendName(), outputAddress, output);
+	return fclose(file) == 0;
+};
+
 void MessageReceived(void* context, void* sender, MIDIEventArgs& e)
 {
-	//if (e.Message.Type() != MessageType::System || (e.Message.SubType() != SystemMessageType::TimingClock && e.Message.SubType() != SystemMessageType::ActiveSensing))
-	//	printf("Message received\n");
+	// Clock and active sensing are filtered out when this is added.
+	//printf("Message received\n");
 };
 
-bool Wait(ReceiveContext* context)
+bool SendAndWait(ReceiveContext* context)
 {
-	context->Event.Wait();
+	Transact(context, s_retry);
 	switch (context->Status)
 	{
 	case ReceiveStatus::Finished:
@@ -605,12 +1030,59 @@ bool Wait(ReceiveContext* context)
 	case ReceiveStatus::Error:
 		printf("Packet error (Expected %02Xh, got %02Xh)\n", context->expectedFunctionin, context->ReceivedFunction);
 		return false;
+	case ReceiveStatus::Timeout:
+		printf("No reply after %u attempts\n", context->Attempt);
+		return false;
 	default:
 		printf("Unexpected state\n");
 		return false;
 	}
 };
 
+// SendAndWait for a combi dump, fetched again if it arrives cut short.
+bool ReceiveDump(ReceiveContext* context)
+{
+	for (unsigned attempt = 1; ; ++attempt)
+	{
+		if (!SendAndWait(context))
+			return false;
+		if (CombiDumps().Check(context->BufferIn, context->rxIndex))
+			return true;
+		ReportDumpLength(context->rxIndex);
+		if (attempt >= s_retry.MaxAttempts)
+		{
+			printf("\n");
+			return false;
+		}
+		printf(", receiving again");
+		fflush(stdout);
+	}
+};
+
+// Why a dump that came back wasn't used.
+void ReportDumpLength(size_t cbDump)
+{
+	if (CombiDumps().IsKnown())
+		printf("Dump cut short at %zu bytes", cbDump);
+	else
+		printf("Dump length %zu not confirmed yet", cbDump);
+};
+
+// A cached combi dump, unless it's shorter than a whole one, as entries saved
+// before dumps were checked may be. Those are thrown away. Nothing is used
+// until the length of whole dumps is known.
+size_t LoadCachedDump(uint8_t bank, uint8_t num, uint8_t* buffer, size_t cbBuffer)
+{
+	size_t size = s_cache.Load(bank, num, buffer, cbBuffer);
+	if (size && !CombiDumps().Check(buffer, size))
+	{
+		if (CombiDumps().IsKnown())
+			s_cache.Invalidate(bank, num);
+		return 0;
+	}
+	return size;
+};
+
 #ifdef _WIN32
 BOOL WINAPI ControlHandler(DWORD fdwCtrlType)
 {
@@ -725,4 +1197,46 @@ static void rawmidi_list(void)
 		inspect(config, 0);
 	}
 }
+
+static void seq_list(void)
+{
+	snd_seq_t* seq;
+	snd_seq_client_info_t *cinfo;
+	snd_seq_port_info_t *pinfo;
+
+	if (snd_seq_open(&seq, "default", SND_SEQ_OPEN_OUTPUT, SND_SEQ_NONBLOCK) < 0)
+		return;
+
+	snd_seq_client_info_alloca(&cinfo);
+	snd_seq_port_info_alloca(&pinfo);
+
+	puts(" Port    Client name                      Port name");
+
+	snd_seq_client_info_set_client(cinfo, -1);
+	while (snd_seq_query_next_client(seq, cinfo) >= 0)
+	{
+		int client = snd_seq_client_info_get_client(cinfo);
+
+		snd_seq_port_info_set_client(pinfo, client);
+		snd_seq_port_info_set_port(pinfo, -1);
+		while (snd_seq_query_next_port(seq, pinfo) >= 0)
+		{
+			/* port must understand MIDI messages */
+			if (!(snd_seq_port_info_get_type(pinfo)
+			      & SND_SEQ_PORT_TYPE_MIDI_GENERIC))
+				continue;
+			/* we need both WRITE and SUBS_WRITE */
+			if ((snd_seq_port_info_get_capability(pinfo)
+			     & (SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE))
+			    != (SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE))
+				continue;
+			printf("%3d:%-3d  %-32.32s %s\n",
+			       snd_seq_port_info_get_client(pinfo),
+			       snd_seq_port_info_get_port(pinfo),
+			       snd_seq_client_info_get_name(cinfo),
+			       snd_seq_port_info_get_name(pinfo));
+		}
+	}
+	snd_seq_close(seq);
+}
 #endif